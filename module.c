@@ -1,6 +1,49 @@
 #include <linux/module.h> 
 #include <linux/kernel.h>
 #include <linux/init.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/poll.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/splice.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "rpncalc.h"
+#include "rpncalc_dev.h"
+
+#define RPNCALC_CHUNK (PAGE_SIZE)		// Bytes of written text or packed values handled at a time.
+#define RPNCALC_RAW_MAX (16)			// Widest binary value, a 128-bit integer.
+
+// State of an open calculator device.
+struct rpncalc_file {
+	int handle;							// Calculator of this file.
+	struct mutex lock;					// Serializes reads and writes.
+	int next;							// Stack position of the next value read.
+	char carry[RPNCALC_NUMBER_MAX];		// Unfinished number from the last write.
+	int ncarry;							// Length of carry.
+	s64 written;						// Bytes of text accepted so far.
+	s64 error;							// Offset of the last bad number, or -1.
+	u8 raw[RPNCALC_RAW_MAX];			// Unfinished binary value from the last splice.
+	int nraw;							// Length of raw.
+	u64 addr;							// User address of the registered buffer.
+	size_t size;						// Size of the registered buffer, or 0.
+	void* buffer;						// Kernel mapping of the registered buffer.
+	struct page** pages;				// Pinned pages of the registered buffer.
+	int npages;							// Number of pages.
+	struct mm_struct* mm;				// Memory the pinned pages are charged to.
+	struct rpncalc_ring* ring;			// Ring of published results, or NULL.
+	struct rpncalc_subscriber subscriber;	// Subscription feeding the ring.
+	wait_queue_head_t wait;				// Pollers waiting for results.
+	u64 polled;							// Results in the ring when poll last saw new ones.
+};
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Daniel Floyd <daniel.m.floyd at gmail.com");
@@ -20,14 +63,826 @@ MODULE_DESCRIPTION("An RPN calculator.");
 
 */
 
+static const struct file_operations rpncalc_fops;
+
+// Calculator constructors by RPNCALC_DEV_* type.
+static int (*const rpncalc_news[])(int* handlep) = {
+	[RPNCALC_DEV_DOUBLE] = rpncalc_new,
+	[RPNCALC_DEV_FLOAT] = rpncalc_new_float,
+	[RPNCALC_DEV_COMPLEX] = rpncalc_new_complex,
+	[RPNCALC_DEV_INT128] = rpncalc_new_int128,
+	[RPNCALC_DEV_DECIMAL] = rpncalc_new_decimal,
+};
+
+static int to_errno(int retval) {
+	switch(retval) {
+		case RPNCALC_E_SUCCESS:
+		{
+			return 0;
+		}
+		case RPNCALC_E_NOMEM:
+		{
+			return -ENOMEM;
+		}
+		case RPNCALC_E_INSUFFICIENT:
+		{
+			return -ENODATA;
+		}
+		case RPNCALC_E_LIMIT:
+		{
+			return -ENOSPC;
+		}
+		default:
+		{
+			return -EINVAL;
+		}
+	}
+}
+
+static void publish_result(struct rpncalc_subscriber* sub, double value) {
+	struct rpncalc_file* rf = container_of(sub, struct rpncalc_file, subscriber);
+	struct rpncalc_ring* ring = rf->ring;
+	u64 n = ring->head;
+	struct rpncalc_result* result = &ring->results[n & (ring->slots - 1)];
+	u64 bits;
+
+	// Clear seq while the slot changes, so a reader of the result it held
+	// sees seq change.
+	memcpy(&bits, &value, sizeof(bits));
+	WRITE_ONCE(result->seq, 0);
+	smp_wmb();
+	WRITE_ONCE(result->value, bits);
+	smp_store_release(&result->seq, n + 1);
+	smp_store_release(&ring->head, n + 1);
+
+	// Readers that are keeping up never sleep, so there is usually no one
+	// to wake.
+	if(wq_has_sleeper(&rf->wait)) {
+		wake_up_interruptible(&rf->wait);
+	}
+}
+
+static void unregister_buffer(struct rpncalc_file* rf) {
+	if(!rf->size) {
+		return;
+	}
+
+	// Unmap and unpin the pages, which the calculator may have written.
+	vunmap((void*)((unsigned long)rf->buffer & PAGE_MASK));
+	unpin_user_pages_dirty_lock(rf->pages, rf->npages, true);
+	account_locked_vm(rf->mm, rf->npages, false);
+	mmdrop(rf->mm);
+	kvfree(rf->pages);
+	rf->size = 0;
+}
+
+static int register_buffer(struct rpncalc_file* rf, struct rpncalc_buffer* req) {
+	unsigned long start = req->addr & PAGE_MASK;
+	struct page** pages;
+	void* mapped;
+	int npages;
+	int pinned;
+	int retval;
+
+	// Registering nothing just drops the old buffer.
+	if(!req->addr || !req->len) {
+		unregister_buffer(rf);
+		return 0;
+	}
+	if(req->len > RPNCALC_BUFFER_MAX) {
+		return -EINVAL;
+	}
+	npages = DIV_ROUND_UP(offset_in_page(req->addr) + req->len, PAGE_SIZE);
+
+	// Pinned pages count against the locked memory limit.
+	retval = account_locked_vm(current->mm, npages, true);
+	if(retval) {
+		return retval;
+	}
+
+	// Pin the pages for as long as the buffer is registered and map them
+	// into one range the calculator can write straight into.
+	pages = kvmalloc_array(npages, sizeof(struct page*), GFP_KERNEL);
+	if(!pages) {
+		retval = -ENOMEM;
+		goto unaccount;
+	}
+	pinned = pin_user_pages_fast(start, npages, FOLL_WRITE | FOLL_LONGTERM, pages);
+	if(pinned != npages) {
+		retval = pinned < 0 ? pinned : -EFAULT;
+		goto unpin;
+	}
+	mapped = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	if(!mapped) {
+		retval = -ENOMEM;
+		goto unpin;
+	}
+
+	// Replace any buffer registered before.
+	unregister_buffer(rf);
+	rf->addr = req->addr;
+	rf->size = req->len;
+	rf->buffer = mapped + offset_in_page(req->addr);
+	rf->pages = pages;
+	rf->npages = npages;
+	rf->mm = current->mm;
+	mmgrab(rf->mm);
+
+	return 0;
+
+unpin:
+	if(pinned > 0) {
+		unpin_user_pages(pages, pinned);
+	}
+	kvfree(pages);
+unaccount:
+	account_locked_vm(current->mm, npages, false);
+
+	return retval;
+}
+
+static void* registered(struct rpncalc_file* rf, u64 addr, u32 len) {
+
+	// Find where a user range lies in the mapping of the registered
+	// buffer, or return NULL if it is not wholly inside it. The address
+	// only names the pinned pages in the memory that registered them, so
+	// any other process, such as a child after fork or one the file was
+	// passed to, goes through a copy instead.
+	if(!rf->size || current->mm != rf->mm) {
+		return NULL;
+	}
+	if(addr < rf->addr || len > rf->size || addr - rf->addr > rf->size - len) {
+		return NULL;
+	}
+
+	return rf->buffer + (addr - rf->addr);
+}
+
+static int rpncalc_open(struct inode* inode, struct file* file) {
+	struct rpncalc_file* rf;
+
+	// Allocate the file state and its calculator.
+	rf = kzalloc(sizeof(struct rpncalc_file), GFP_KERNEL);
+	if(!rf) {
+		return -ENOMEM;
+	}
+	if(rpncalc_new(&rf->handle) != RPNCALC_E_SUCCESS) {
+		kfree(rf);
+		return -ENOMEM;
+	}
+	mutex_init(&rf->lock);
+	rf->error = -1;
+	rf->subscriber.publish = publish_result;
+	init_waitqueue_head(&rf->wait);
+	file->private_data = rf;
+
+	return stream_open(inode, file);
+}
+
+static int rpncalc_release(struct inode* inode, struct file* file) {
+	struct rpncalc_file* rf = file->private_data;
+
+	rpncalc_unsubscribe(&rf->subscriber);
+	unregister_buffer(rf);
+	rpncalc_delete(rf->handle);
+	vfree(rf->ring);
+	kfree(rf);
+
+	return 0;
+}
+
+static ssize_t rpncalc_read(struct file* file, char __user* buf, size_t count, loff_t* ppos) {
+	struct rpncalc_file* rf = file->private_data;
+	size_t len = min_t(size_t, count, RPNCALC_CHUNK);
+	char* text;
+	int next;
+	int used;
+	int retval;
+
+	// A read of no bytes neither moves through the stack nor starts it over.
+	if(!count) {
+		return 0;
+	}
+
+	text = kmalloc(len, GFP_KERNEL);
+	if(!text) {
+		return -ENOMEM;
+	}
+
+	// Format the values after those already read.
+	mutex_lock(&rf->lock);
+	next = rf->next;
+	retval = rpncalc_print(rf->handle, &rf->next, text, len, &used);
+	if(retval != RPNCALC_E_SUCCESS) {
+		retval = to_errno(retval);
+	} else if(copy_to_user(buf, text, used)) {
+		rf->next = next;
+		retval = -EFAULT;
+	} else {
+		retval = used;
+	}
+
+	// After the end of the stack has been reported, start over.
+	if(!retval) {
+		rf->next = 0;
+	}
+	mutex_unlock(&rf->lock);
+
+	kfree(text);
+
+	return retval;
+}
+
+static ssize_t rpncalc_write(struct file* file, const char __user* buf, size_t count, loff_t* ppos) {
+	struct rpncalc_file* rf = file->private_data;
+	ssize_t done = 0;
+	char* text;
+	int used;
+	int len;
+	int n;
+	int retval = RPNCALC_E_SUCCESS;
+
+	text = kmalloc(RPNCALC_NUMBER_MAX + RPNCALC_CHUNK, GFP_KERNEL);
+	if(!text) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&rf->lock);
+	while(done < count) {
+
+		// Parse a chunk with the unfinished number from before in front.
+		n = min_t(size_t, count - done, RPNCALC_CHUNK);
+		if(copy_from_user(text + rf->ncarry, buf + done, n)) {
+			retval = -EFAULT;
+			break;
+		}
+		memcpy(text, rf->carry, rf->ncarry);
+		len = rf->ncarry + n;
+		retval = rpncalc_push_text(rf->handle, text, len, &used);
+
+		// A number too long to carry over is as bad as any other.
+		if(retval == RPNCALC_E_SUCCESS && len - used > RPNCALC_NUMBER_MAX) {
+			retval = RPNCALC_E_INVALID;
+		}
+		if(retval != RPNCALC_E_SUCCESS) {
+
+			// Accept the text before the bad number. A bad number that
+			// started in an earlier write is dropped.
+			rf->error = rf->written - rf->ncarry + used;
+			used = max(used - rf->ncarry, 0);
+			rf->ncarry = 0;
+			rf->written += used;
+			done += used;
+			retval = to_errno(retval);
+			break;
+		}
+
+		// Keep the unfinished number for the next chunk.
+		memmove(rf->carry, text + used, len - used);
+		rf->ncarry = len - used;
+		rf->written += n;
+		done += n;
+	}
+	mutex_unlock(&rf->lock);
+
+	kfree(text);
+
+	// Report a short write if anything was accepted.
+	return done ? done : retval;
+}
+
+static int pipe_to_rpncalc(struct pipe_inode_info* pipe, struct pipe_buffer* buf, struct splice_desc* sd) {
+	struct rpncalc_file* rf = sd->u.file->private_data;
+	void* page;
+	const u8* data;
+	int len = sd->len;
+	int used;
+	int n;
+	int retval;
+
+	// Push the values straight from the pipe's page.
+	page = kmap_local_page(buf->page);
+	data = page + buf->offset;
+
+	// Finish the value split across buffers first.
+	if(rf->nraw) {
+		n = min_t(int, len, RPNCALC_RAW_MAX - rf->nraw);
+		memcpy(rf->raw + rf->nraw, data, n);
+		retval = rpncalc_push_raw(rf->handle, rf->raw, rf->nraw + n, &used);
+		if(retval != RPNCALC_E_SUCCESS) {
+			goto out;
+		}
+		if(used < rf->nraw) {
+			rf->nraw += n;
+			goto out;
+		}
+		data += used - rf->nraw;
+		len -= used - rf->nraw;
+		rf->nraw = 0;
+	}
+
+	// Push the whole values and keep the rest for the next buffer.
+	retval = rpncalc_push_raw(rf->handle, data, len, &used);
+	if(retval == RPNCALC_E_SUCCESS) {
+		memcpy(rf->raw, data + used, len - used);
+		rf->nraw = len - used;
+	}
+
+out:
+	kunmap_local(page);
+
+	return retval == RPNCALC_E_SUCCESS ? sd->len : to_errno(retval);
+}
+
+static ssize_t rpncalc_splice_write(struct pipe_inode_info* pipe, struct file* file, loff_t* ppos, size_t len, unsigned int flags) {
+	struct rpncalc_file* rf = file->private_data;
+	ssize_t retval;
+
+	// Pipe buffers hold binary values rather than text.
+	mutex_lock(&rf->lock);
+	retval = splice_from_pipe(pipe, file, ppos, len, flags, pipe_to_rpncalc);
+	mutex_unlock(&rf->lock);
+
+	return retval;
+}
+
+static int source_handle(int fd, int* handlep) {
+	struct rpncalc_file* src;
+	struct fd f;
+
+	// Results are only for those who can read the calculator themselves,
+	// so it is named by an open file of it rather than by its handle.
+	*handlep = -1;
+	if(fd < 0) {
+		return 0;
+	}
+	f = fdget(fd);
+	if(!fd_file(f)) {
+		return -EBADF;
+	}
+	if(fd_file(f)->f_op != &rpncalc_fops || !(fd_file(f)->f_mode & FMODE_READ)) {
+		fdput(f);
+		return -EINVAL;
+	}
+	src = fd_file(f)->private_data;
+	mutex_lock(&src->lock);
+	*handlep = src->handle;
+	mutex_unlock(&src->lock);
+	fdput(f);
+
+	return 0;
+}
+
+static int subscribe(struct rpncalc_file* rf, int source, struct rpncalc_subscription* req) {
+	struct rpncalc_ring* ring;
+
+	// End the subscription before.
+	rpncalc_unsubscribe(&rf->subscriber);
+	if(source < 0) {
+		return 0;
+	}
+
+	// Make the ring the first time, zeroed so no slot looks written. It
+	// can be megabytes per open file, so charge it to the caller's memory
+	// cgroup like the stacks.
+	if(!rf->ring) {
+		if(!is_power_of_2(req->slots) || req->slots > RPNCALC_RING_MAX) {
+			return -EINVAL;
+		}
+		ring = __vmalloc(struct_size(ring, results, req->slots), GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+		if(!ring) {
+			return -ENOMEM;
+		}
+		ring->slots = req->slots;
+		smp_store_release(&rf->ring, ring);
+	}
+
+	// The source may have replaced its calculator since its handle was read.
+	if(rpncalc_subscribe(source, &rf->subscriber) != RPNCALC_E_SUCCESS) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int read_changes(struct rpncalc_file* rf, struct rpncalc_log* req) {
+	struct rpncalc_change* changes;
+	struct rpncalc_delta delta;
+	struct rpncalc_delta __user* data = u64_to_user_ptr(req->data);
+	int count;
+	int status;
+	int i;
+	int retval;
+
+	changes = kmalloc_array(clamp_t(u32, req->max, 1, RPNCALC_CHANGES), sizeof(struct rpncalc_change), GFP_KERNEL);
+	if(!changes) {
+		return -ENOMEM;
+	}
+
+	// Read the changes before the version, so it is at least as new as the
+	// last of them. The version is wanted even if the changes are gone.
+	req->count = 0;
+	retval = rpncalc_changes(rf->handle, req->since, changes, min_t(u32, req->max, RPNCALC_CHANGES), &count);
+	if(retval == RPNCALC_E_SUCCESS || retval == RPNCALC_E_LIMIT) {
+		status = rpncalc_version(rf->handle, &req->version);
+		retval = status == RPNCALC_E_SUCCESS ? retval : status;
+	}
+	retval = retval == RPNCALC_E_LIMIT ? -ESTALE : to_errno(retval);
+
+	// Copy them out in the device's layout.
+	for(i = 0; !retval && i < count; i++) {
+		delta.version = changes[i].version;
+		delta.kind = changes[i].kind;
+		delta.count = changes[i].count;
+		memcpy(&delta.value, &changes[i].value, sizeof(delta.value));
+		if(copy_to_user(&data[i], &delta, sizeof(delta))) {
+			retval = -EFAULT;
+		}
+	}
+	if(!retval) {
+		req->count = count;
+	}
+
+	kfree(changes);
+
+	return retval;
+}
+
+static int replace_calculator(struct rpncalc_file* rf, u32 type) {
+	int handle;
+
+	// Make the new calculator before letting go of the old one.
+	if(type >= ARRAY_SIZE(rpncalc_news)) {
+		return -EINVAL;
+	}
+	if(rpncalc_news[type](&handle) != RPNCALC_E_SUCCESS) {
+		return -ENOMEM;
+	}
+	rpncalc_delete(rf->handle);
+	rf->handle = handle;
+	rf->next = 0;
+	rf->ncarry = 0;
+	rf->nraw = 0;
+
+	return 0;
+}
+
+static int push_packed(struct rpncalc_file* rf, struct rpncalc_packed* req) {
+	const u8 __user* data = u64_to_user_ptr(req->data);
+	u8* buf;
+	int used;
+	int n;
+	int retval = RPNCALC_E_SUCCESS;
+
+	// Values in the registered buffer are pushed from where they are.
+	buf = registered(rf, req->data, req->len);
+	if(buf) {
+		invalidate_kernel_vmap_range(buf, req->len);
+		retval = to_errno(rpncalc_push_packed(rf->handle, buf, req->len, &used));
+		req->used = used;
+		return retval;
+	}
+
+	buf = kmalloc(RPNCALC_CHUNK, GFP_KERNEL);
+	if(!buf) {
+		return -ENOMEM;
+	}
+
+	// Push a chunk at a time. A value cut off by the end of a chunk starts
+	// the next one, and one cut off by the end of the buffer ends the push.
+	req->used = 0;
+	while(req->used < req->len) {
+		n = min_t(u32, req->len - req->used, RPNCALC_CHUNK);
+		if(copy_from_user(buf, data + req->used, n)) {
+			retval = -EFAULT;
+			break;
+		}
+		retval = to_errno(rpncalc_push_packed(rf->handle, buf, n, &used));
+		req->used += used;
+		if(retval || !used) {
+			break;
+		}
+	}
+
+	kfree(buf);
+
+	return retval;
+}
+
+static int pop_packed(struct rpncalc_file* rf, struct rpncalc_packed* req) {
+	u8 __user* data = u64_to_user_ptr(req->data);
+	u8* buf;
+	int index;
+	int size;
+	u32 done = 0;
+	int used;
+	int n;
+	int retval;
+
+	if(req->count > INT_MAX) {
+		return -EINVAL;
+	}
+
+	// Values popped into the registered buffer are written there directly.
+	buf = registered(rf, req->data, req->len);
+	if(buf) {
+		retval = to_errno(rpncalc_pop_packed(rf->handle, req->count, buf, req->len, &used));
+		flush_kernel_vmap_range(buf, req->len);
+		req->used = retval ? 0 : used;
+		return retval;
+	}
+
+	// Find where the values start.
+	retval = to_errno(rpncalc_size(rf->handle, &size));
+	if(retval) {
+		return retval;
+	}
+	if(req->count > size) {
+		return -ENODATA;
+	}
+
+	buf = kmalloc(RPNCALC_CHUNK, GFP_KERNEL);
+	if(!buf) {
+		return -ENOMEM;
+	}
+
+	// Save the values a chunk at a time, then drop them once they are all
+	// copied out. The file lock keeps the stack from changing in between,
+	// and a value that does not fit fails the pop with the stack as it was.
+	index = size - req->count;
+	while(index < size) {
+		n = min_t(u32, req->len - done, RPNCALC_CHUNK);
+		retval = rpncalc_save(rf->handle, &index, buf, n, &used);
+		if(retval == RPNCALC_E_INVALID) {
+			retval = RPNCALC_E_LIMIT;
+		}
+		retval = to_errno(retval);
+		if(retval) {
+			break;
+		}
+		if(copy_to_user(data + done, buf, used)) {
+			retval = -EFAULT;
+			break;
+		}
+		done += used;
+	}
+	if(!retval) {
+		retval = to_errno(rpncalc_drop(rf->handle, req->count));
+	}
+	req->used = retval ? 0 : done;
+
+	kfree(buf);
+
+	return retval;
+}
+
+static int save_packed(struct rpncalc_file* rf, struct rpncalc_packed* req) {
+	u8 __user* data = u64_to_user_ptr(req->data);
+	int index = req->index;
+	u8* buf;
+	int used;
+	int n;
+	int retval = 0;
+
+	if(req->index > INT_MAX) {
+		return -EINVAL;
+	}
+
+	// Values saved to the registered buffer are written there directly.
+	buf = registered(rf, req->data, req->len);
+	if(buf) {
+		retval = to_errno(rpncalc_save(rf->handle, &index, buf, req->len, &used));
+		flush_kernel_vmap_range(buf, req->len);
+		req->used = retval ? 0 : used;
+		req->index = index;
+		return retval;
+	}
+
+	buf = kmalloc(RPNCALC_CHUNK, GFP_KERNEL);
+	if(!buf) {
+		return -ENOMEM;
+	}
+
+	// Save a chunk at a time until the buffer or the stack runs out. The
+	// buffer running out partway through a value is only an error if
+	// nothing was saved.
+	req->used = 0;
+	while(req->used < req->len) {
+		n = min_t(u32, req->len - req->used, RPNCALC_CHUNK);
+		retval = rpncalc_save(rf->handle, &index, buf, n, &used);
+		if(retval == RPNCALC_E_INVALID && req->used && n < RPNCALC_CHUNK) {
+			retval = RPNCALC_E_SUCCESS;
+		}
+		retval = to_errno(retval);
+		if(retval || !used) {
+			break;
+		}
+		if(copy_to_user(data + req->used, buf, used)) {
+			retval = -EFAULT;
+			break;
+		}
+		req->used += used;
+		req->index = index;
+	}
+
+	kfree(buf);
+
+	return retval;
+}
+
+static long rpncalc_ioctl(struct file* file, unsigned int cmd, unsigned long arg) {
+	struct rpncalc_file* rf = file->private_data;
+	struct rpncalc_packed req;
+	struct rpncalc_buffer buffer;
+	struct rpncalc_subscription subscription;
+	struct rpncalc_log log;
+	u32 type;
+	int handle;
+	int retval;
+
+	switch(cmd) {
+		case RPNCALC_IOC_ERROR:
+		{
+			return put_user(rf->error, (s64 __user*)arg);
+		}
+		case RPNCALC_IOC_NEW:
+		{
+			if(get_user(type, (u32 __user*)arg)) {
+				return -EFAULT;
+			}
+			mutex_lock(&rf->lock);
+			retval = replace_calculator(rf, type);
+			mutex_unlock(&rf->lock);
+			return retval;
+		}
+		case RPNCALC_IOC_REGISTER:
+		{
+			if(copy_from_user(&buffer, (void __user*)arg, sizeof(buffer))) {
+				return -EFAULT;
+			}
+			mutex_lock(&rf->lock);
+			retval = register_buffer(rf, &buffer);
+			mutex_unlock(&rf->lock);
+			return retval;
+		}
+		case RPNCALC_IOC_SUBSCRIBE:
+		{
+			if(copy_from_user(&subscription, (void __user*)arg, sizeof(subscription))) {
+				return -EFAULT;
+			}
+
+			// Read the source's handle before locking this file, which may
+			// be the source.
+			retval = source_handle(subscription.fd, &handle);
+			if(retval) {
+				return retval;
+			}
+			mutex_lock(&rf->lock);
+			retval = subscribe(rf, handle, &subscription);
+			mutex_unlock(&rf->lock);
+			return retval;
+		}
+		case RPNCALC_IOC_CHANGES:
+		{
+			if(copy_from_user(&log, (void __user*)arg, sizeof(log))) {
+				return -EFAULT;
+			}
+			mutex_lock(&rf->lock);
+			retval = read_changes(rf, &log);
+			mutex_unlock(&rf->lock);
+
+			// Report the version even if the changes are gone.
+			if(copy_to_user((void __user*)arg, &log, sizeof(log))) {
+				return -EFAULT;
+			}
+			return retval;
+		}
+		case RPNCALC_IOC_PUSH:
+		case RPNCALC_IOC_POP:
+		case RPNCALC_IOC_SAVE:
+		{
+			if(copy_from_user(&req, (void __user*)arg, sizeof(req))) {
+				return -EFAULT;
+			}
+			mutex_lock(&rf->lock);
+			if(cmd == RPNCALC_IOC_PUSH) {
+				retval = push_packed(rf, &req);
+			} else if(cmd == RPNCALC_IOC_POP) {
+				retval = pop_packed(rf, &req);
+			} else {
+				retval = save_packed(rf, &req);
+			}
+			mutex_unlock(&rf->lock);
+
+			// Report how far it got even on failure.
+			if(copy_to_user((void __user*)arg, &req, sizeof(req))) {
+				return -EFAULT;
+			}
+			return retval;
+		}
+		default:
+		{
+			return -ENOTTY;
+		}
+	}
+}
+
+static __poll_t rpncalc_poll(struct file* file, poll_table* wait) {
+	struct rpncalc_file* rf = file->private_data;
+	struct rpncalc_ring* ring = smp_load_acquire(&rf->ring);
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+	u64 head;
+
+	// Always register on the wait queue, even before a subscription sets
+	// up the ring: epoll only hooks in through the first poll, when the
+	// file is added.
+	poll_wait(file, &rf->wait, wait);
+
+	// Readable once results arrive after the last time this said so.
+	if(ring) {
+		head = smp_load_acquire(&ring->head);
+		if(head != READ_ONCE(rf->polled)) {
+			WRITE_ONCE(rf->polled, head);
+			mask |= EPOLLIN | EPOLLRDNORM;
+		}
+	}
+
+	return mask;
+}
+
+static int rpncalc_mmap(struct file* file, struct vm_area_struct* vma) {
+	struct rpncalc_file* rf = file->private_data;
+	struct rpncalc_ring* ring = smp_load_acquire(&rf->ring);
+	unsigned long pages;
+	unsigned long i;
+	int retval;
+
+	// Only the kernel writes the ring.
+	if(!ring) {
+		return -ENODEV;
+	}
+	if(vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	// Make sure the mapping lies within the ring.
+	pages = PAGE_ALIGN(struct_size(ring, results, ring->slots)) >> PAGE_SHIFT;
+	if(vma->vm_pgoff > pages || (vma->vm_end - vma->vm_start) >> PAGE_SHIFT > pages - vma->vm_pgoff) {
+		return -EINVAL;
+	}
+
+	// The ring is charged to the memory cgroup, so it lacks the VM_USERMAP
+	// of vmalloc_user that remap_vmalloc_range needs. Insert its pages one
+	// by one instead.
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	for(i = 0; i < (vma->vm_end - vma->vm_start) >> PAGE_SHIFT; i++) {
+		retval = vm_insert_page(vma, vma->vm_start + (i << PAGE_SHIFT), vmalloc_to_page((void*)ring + ((vma->vm_pgoff + i) << PAGE_SHIFT)));
+		if(retval) {
+			return retval;
+		}
+	}
+
+	return 0;
+}
+
+static const struct file_operations rpncalc_fops = {
+	.owner = THIS_MODULE,
+	.open = rpncalc_open,
+	.release = rpncalc_release,
+	.read = rpncalc_read,
+	.write = rpncalc_write,
+	.splice_write = rpncalc_splice_write,
+	.poll = rpncalc_poll,
+	.mmap = rpncalc_mmap,
+	.unlocked_ioctl = rpncalc_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+static struct miscdevice rpncalc_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "rpncalc",
+	.fops = &rpncalc_fops,
+	.mode = 0660,						// Owner and group only: every open file can grow a stack.
+};
+
 static int __init rpncalc_init(void)
 {
+    int retval;
+
     printk(KERN_INFO "rpncalc_init\n");
-    return 0;    // Non-zero return means that the module couldn't be loaded.
+    rpncalc_start();
+    retval = misc_register(&rpncalc_device);
+    if(retval) {
+        rpncalc_stop();
+    }
+    return retval;    // Non-zero return means that the module couldn't be loaded.
 }
 
 static void __exit rpncalc_cleanup(void)
 {
+    misc_deregister(&rpncalc_device);
+    rpncalc_stop();
     printk(KERN_INFO "rpncalc_cleanup\n");
 }
 
@@ -1,22 +1,259 @@
 
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/list.h>
 #include <linux/hashtable.h>
 #include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/kref.h>
+#include <linux/overflow.h>
+#include <linux/sched.h>
+#include <linux/log2.h>
+#include <linux/bitops.h>
+#include <linux/types.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+#include <linux/topology.h>
+#include <linux/nodemask.h>
+#include <linux/static_call.h>
+#include <linux/unaligned.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
 
 #include "rpncalc.h"
 
-struct rpncalc_entry {
-	double value;						// The value of this entry.
-	struct list_head next;				// Linked list pointers for stack.
+#define RPNCALC_INLINE_MAX (8)			// Longest word inlined into its caller.
+#define RPNCALC_CALL_DEPTH (16)			// Deepest nesting of word calls.
+#define RPNCALC_NEST_DEPTH (8)			// Deepest nesting of conditionals and loops.
+#define RPNCALC_RESCHED_STEPS (4096)	// Instructions run between preemption points.
+#define RPNCALC_SKETCH_BINS (2048)		// Buckets per sign in a quantile sketch.
+#define RPNCALC_SKETCH_ACCURACY (1e-6)	// Finest accuracy of a quantile sketch.
+#define RPNCALC_HLL_BITS (12)			// Index bits of HyperLogLog registers.
+#define RPNCALC_MIN_CAPACITY (16)		// Smallest stack allocation, in values.
+#define RPNCALC_SORT_SMALL (16)			// Ranges this short are insertion sorted.
+#define RPNCALC_BLOCK (32)				// Edge of the tiles matrices are processed in.
+#define RPNCALC_VECTOR_CHUNK (4096)		// Values handled per FPU section by the bulk kernels.
+#define RPNCALC_DECIMAL_ONE (1000000000000000000ULL)	// 10^RPNCALC_DECIMAL_DIGITS.
+
+struct rpncalc_register {
+	char name[RPNCALC_NAME_MAX];		// Name of this register.
+	double value;						// The value stored in this register.
+};
+
+// Program instruction opcodes.
+enum rpncalc_opcode {
+	OP_PUSH,							// Push an immediate value.
+	OP_ADD,								// Add the top two values.
+	OP_SUBTRACT,						// Subtract the top two values.
+	OP_MULTIPLY,						// Multiply the top two values.
+	OP_DIVIDE,							// Divide the top two values.
+	OP_LESS,							// Compare the top two values, giving 1 or 0.
+	OP_LESS_EQUAL,
+	OP_GREATER,
+	OP_GREATER_EQUAL,
+	OP_EQUAL,
+	OP_NOT_EQUAL,
+	OP_REMAINDER,						// Remainder of the top two integers, for rpncalc_iop only.
+	OP_SELECT,							// Pick one of two values by a condition.
+	OP_STO,								// Store the top value in a register.
+	OP_RCL,								// Push the value of a register.
+	OP_CALL,							// Run another program.
+	OP_JZ,								// Pop a value and jump if it is zero.
+	OP_JMP,								// Jump unconditionally.
+	OP_DO,								// Pop a count and start a loop, or skip it.
+	OP_LOOP,							// Count down and jump back to the loop body.
+	OP_THEN,							// End of a conditional, compile time only.
+};
+
+struct rpncalc_insn {
+	int opcode;							// Operation to perform.
+	union {
+		double value;					// Immediate value for OP_PUSH.
+		int slot;						// Register slot for OP_STO and OP_RCL.
+		struct rpncalc_program* program;	// Callee for OP_CALL.
+		int target;						// Jump target for OP_JZ, OP_JMP, OP_DO and OP_LOOP.
+	};
+};
+
+struct rpncalc_program {
+	struct kref ref;					// Reference count, held by words and calls.
+	int needs;							// Stack depth required to run.
+	int effect;							// Net change in stack size after running.
+	int peak;							// Most values above the entry depth at once.
+	int depth;							// Call nesting depth, including this program.
+	int length;							// Number of instructions.
+	struct rpncalc_insn insns[];		// The instructions.
+};
+
+struct rpncalc_word {
+	char name[RPNCALC_NAME_MAX];		// Name of this word.
+	struct rpncalc_program* program;	// Compiled body of this word.
+	struct list_head next;				// Linked list pointers for word list.
+};
+
+struct rpncalc_frame {
+	int opcode;							// OP_JZ, OP_JMP or OP_DO that opened the frame.
+	int insn;							// Index of that instruction.
+	int depth;							// Stack depth at the start of the body.
+	int branch;							// Stack depth at the end of the first branch.
+};
+
+struct rpncalc_compiler {
+	struct rpncalc* calc;				// Calculator names resolve against, or NULL.
+	struct rpncalc_insn* insns;			// Instruction buffer.
+	int length;							// Number of instructions emitted.
+	int depth;							// Stack depth relative to program entry.
+	int needs;							// Deepest stack access relative to entry.
+	int peak;							// Highest stack depth relative to entry.
+	int calls;							// Deepest call nesting of emitted calls.
+	struct rpncalc_frame frames[RPNCALC_NEST_DEPTH];	// Open conditionals and loops.
+	int nframes;						// Number of open frames.
+};
+
+struct rpncalc_run {
+	long steps;							// Instructions charged so far.
+	long budget;						// Maximum instructions for this run.
+	long resched;						// Step count of the next preemption point.
+};
+
+// Kinds of calculator, by what rpncalc_push does with a value.
+enum rpncalc_kind {
+	KIND_STACK,							// Push the value onto the stack.
+	KIND_WINDOW,						// Add the value to a sliding window.
+	KIND_ACCUM,							// Fold the value into running statistics.
+	KIND_QUANTILE,						// Add the value to a quantile sketch.
+	KIND_DISTINCT,						// Add the value to a distinct count sketch.
+};
+
+struct rpncalc_deque {
+	u64* seqs;							// Ring buffer of value sequence numbers.
+	int head;							// Index of the front entry.
+	int count;							// Number of entries.
+};
+
+struct rpncalc_window {
+	int size;							// Maximum number of values in the window.
+	int count;							// Number of values in the window.
+	u64 seq;							// Sequence number of the next value.
+	double sum;							// Running sum of the finite values.
+	double error;						// Running rounding error of the sum.
+	int infinities;						// Number of +inf values.
+	int neg_infinities;					// Number of -inf values.
+	int nans;							// Number of NaN values.
+	double* values;						// Ring buffer of values, indexed by seq % size.
+	struct rpncalc_deque min;			// Increasing candidates for the minimum.
+	struct rpncalc_deque max;			// Decreasing candidates for the maximum.
+};
+
+struct rpncalc_accum {
+	u64 count;							// Number of values.
+	double mean;						// Running mean (Welford).
+	double m2;							// Sum of squared deviations from the mean.
+	double min;							// Smallest value.
+	double max;							// Largest value.
+	double alpha;						// Smoothing factor of the moving average.
+	double ema;							// Exponential moving average.
+};
+
+struct rpncalc_store {
+	int offset;							// Bucket index of counts[0].
+	int lo;								// Lowest bucket index in use.
+	int hi;								// Highest bucket index in use.
+	u64 total;							// Number of values in the store.
+	u64 counts[RPNCALC_SKETCH_BINS];	// Number of values in each bucket.
+};
+
+struct rpncalc_quantile {
+	double gamma;						// Ratio between bucket bounds.
+	double lngamma;						// Natural logarithm of gamma.
+	double accuracy;					// Relative accuracy of quantiles.
+	u64 zeros;							// Number of zero values.
+	double sum;							// Sum of values.
+	double min;							// Smallest value.
+	double max;							// Largest value.
+	struct rpncalc_store positive;		// Buckets of positive values.
+	struct rpncalc_store negative;		// Buckets of negated negative values.
+};
+
+struct rpncalc_hll {
+	u64 count;							// Number of values.
+	u8 registers[1 << RPNCALC_HLL_BITS];	// Longest hash prefix seen per register.
+};
+
+// Types of value a calculator stack holds.
+enum rpncalc_type {
+	TYPE_DOUBLE,						// Doubles.
+	TYPE_COMPLEX,						// Complex numbers as pairs of doubles.
+	TYPE_INT128,						// 128-bit integers.
+	TYPE_DECIMAL,						// 128-bit integers scaled by 10^RPNCALC_DECIMAL_DIGITS.
+	TYPE_FLOAT,							// Single precision floats.
+};
+
+#define TYPE_BIT(type) (1 << (type))	// Bit for a type in a mask of types.
+#define TYPES_REAL (TYPE_BIT(TYPE_DOUBLE) | TYPE_BIT(TYPE_FLOAT))	// Types read as doubles.
+
+struct rpncalc_complex {
+	double re;							// Real part.
+	double im;							// Imaginary part.
+};
+
+// Operations on the stack of one type. Each type's operations are generated
+// from the templates below for its C type, so none of them checks the type
+// of a value. Operations a type does not have are NULL.
+struct rpncalc_ops {
+	int type;							// Type of stack values, see enum rpncalc_type.
+	int width;							// Size of a stack value in bytes.
+	double (*get)(const void* data, int index);	// Read a value as a double.
+	void (*set)(void* data, int index, double value);	// Write a value from a double.
+	int (*binary[OP_SELECT])(void* data, int size);	// Combine the top two values, by opcode, giving an error code.
+	void (*select)(void* data, int size);	// Pick one of two values by a condition.
+	void (*prefix_sum)(void* data, int index, int count);	// Running totals of values.
+	double (*dot_product)(const void* data, int index, int count);	// Dot product of two runs of values.
 };
 
 struct rpncalc {
 	int handle;							// Assigned handle for this rpncalc.
 	struct mutex lock;					// Calculator lock.
-	struct list_head stack;				// The stack for this calculator.
+	struct kref ref;					// Reference count, held by the table and lookups.
+	union {
+		void* data;						// The stack for this calculator, top last.
+		double* values;					// Stack of TYPE_DOUBLE.
+		struct rpncalc_complex* complexes;	// Stack of TYPE_COMPLEX.
+		s128* integers;					// Stack of TYPE_INT128 and TYPE_DECIMAL.
+		float* floats;					// Stack of TYPE_FLOAT.
+	};
 	int size;							// The size of the stack.
+	int capacity;						// Number of values the stack has room for.
+	const struct rpncalc_ops* ops;		// Operations of the stack's type.
+	int huge;							// Whether the stack is backed by huge pages.
+	int node;							// NUMA node the stack is allocated on.
+	int remote_node;					// Node of the last access from elsewhere.
+	int remote_hits;					// Accesses in a row from remote_node.
+	u64* packed;						// Compressed stack while idle, or NULL.
+	u64 version;						// Number of changes made to the stack.
+	struct rpncalc_change* changes;		// Last RPNCALC_CHANGES changes, by version, or NULL.
+	u64 logged;							// Version the change log started at.
+	unsigned long touched;				// Time of the last stack access, in jiffies.
+	struct rpncalc_register registers[RPNCALC_REGISTERS];	// Named registers.
+	int nregisters;						// Number of registers in use.
+	long budget;						// Instruction budget for each program run.
+	struct list_head words;				// Words defined on this calculator.
+	struct list_head subscribers;		// Receivers of results, see rpncalc_subscribe.
+	int kind;							// Kind of calculator, see enum rpncalc_kind.
+	union {
+		struct rpncalc_window* window;	// Sliding window for KIND_WINDOW.
+		struct rpncalc_accum* accum;	// Running statistics for KIND_ACCUM.
+		struct rpncalc_quantile* quantile;	// Quantile sketch for KIND_QUANTILE.
+		struct rpncalc_hll* hll;		// Distinct count sketch for KIND_DISTINCT.
+	};
 	struct hlist_node next;				// Hash list pointers for calculator hashtable.
+	struct list_head idle;				// Entry in the candidates of a compression pass.
 };
 
 DEFINE_HASHTABLE(calcs, 3);				// Declare the calculators hashtable.
@@ -24,14 +261,361 @@ DEFINE_MUTEX(calcs_lock);				// Declare calculators hashtable lock.
 
 static unsigned int next_handle = 0;	// Keeps track of the next available calculator handle.
 
+static LIST_HEAD(words);				// Declare the global word list.
+DEFINE_MUTEX(words_lock);				// Declare global word list lock.
+
+// Seconds a stack must go unused before it is compressed, or 0 to never
+// compress stacks.
+static unsigned int idle_seconds = 60;
+module_param(idle_seconds, uint, 0644);
+MODULE_PARM_DESC(idle_seconds, "Seconds before an unused calculator stack is compressed (0 disables)");
+
+// Stacks of at least this many KiB are allocated from huge pages where the
+// kernel can map them, or 0 to always use base pages.
+static unsigned int huge_kb = 2048;
+module_param(huge_kb, uint, 0644);
+MODULE_PARM_DESC(huge_kb, "Smallest stack in KiB backed by huge pages (0 disables)");
+
+// Accesses in a row from another NUMA node before a stack is moved there, or
+// 0 to leave stacks where they were created.
+static unsigned int migrate_accesses = 0;
+module_param(migrate_accesses, uint, 0644);
+MODULE_PARM_DESC(migrate_accesses, "Accesses in a row from another NUMA node before a stack moves there (0 disables)");
+
+// Implementation of the bulk kernels to use instead of the best one the CPU
+// supports, for benchmarking.
+static char* kernels = "";
+module_param(kernels, charp, 0444);
+MODULE_PARM_DESC(kernels, "Force an implementation of the bulk kernels (generic, avx2, avx512)");
+
+static atomic_t huge_stacks = ATOMIC_INIT(0);	// Number of stacks backed by huge pages.
+
+static void compress_idle(struct work_struct* work);
+static DECLARE_DELAYED_WORK(compress_work, compress_idle);	// Background compression pass.
+
+// Builtin tokens of the program language. These names cannot be redefined.
+static const struct {
+	const char* name;
+	int opcode;
+} builtins[] = {
+	{ "+", OP_ADD },
+	{ "-", OP_SUBTRACT },
+	{ "*", OP_MULTIPLY },
+	{ "/", OP_DIVIDE },
+	{ "<", OP_LESS },
+	{ "<=", OP_LESS_EQUAL },
+	{ ">", OP_GREATER },
+	{ ">=", OP_GREATER_EQUAL },
+	{ "=", OP_EQUAL },
+	{ "!=", OP_NOT_EQUAL },
+	{ "select", OP_SELECT },
+	{ "sto", OP_STO },
+	{ "rcl", OP_RCL },
+	{ "if", OP_JZ },
+	{ "else", OP_JMP },
+	{ "then", OP_THEN },
+	{ "do", OP_DO },
+	{ "loop", OP_LOOP },
+};
+
 static struct rpncalc* get_rpncalc(int handle);
-static struct rpncalc_entry* new_entry(void);
-static int push(struct rpncalc* calc, struct rpncalc_entry* entry);
-static int pop(struct rpncalc* calc, struct rpncalc_entry** entryp);
-static int do_add(struct rpncalc* calc);
-static int do_substract(struct rpncalc* calc);
-static int do_multiply(struct rpncalc* calc);
-static int do_divide(struct rpncalc* calc);
+static struct rpncalc* create_rpncalc(int node);
+static void insert_rpncalc(struct rpncalc* calc, int* handlep);
+static void free_rpncalc(struct kref* ref);
+static void put_rpncalc(struct rpncalc* calc);
+static void unlock_rpncalc(struct rpncalc* calc);
+static void lock_pair(struct rpncalc* calc1, struct rpncalc* calc2);
+static void* alloc_stack(struct rpncalc* calc, int* capacityp, int* hugep);
+static void set_stack(struct rpncalc* calc, void* data, int capacity, int huge);
+static void free_stack(struct rpncalc* calc);
+static int reserve(struct rpncalc* calc, int count);
+static void shrink(struct rpncalc* calc);
+static int push(struct rpncalc* calc, double value);
+static int pop(struct rpncalc* calc, double* valuep);
+static int do_binary(struct rpncalc* calc, int opcode);
+static int do_select(struct rpncalc* calc);
+static int valid_name(const char* name);
+static int find_register(struct rpncalc* calc, const char* name);
+static struct rpncalc_word* find_word(struct list_head* list, const char* name, int len);
+static struct rpncalc_program* get_word(struct rpncalc* calc, const char* name, int len);
+static void free_program(struct kref* ref);
+static void put_program(struct rpncalc_program* program);
+static const char* next_token(const char* text, int* lenp);
+static int parse_number(const char* token, int len, double* valuep);
+static void emit(struct rpncalc_compiler* compiler, struct rpncalc_insn* insn, int pops, int pushes);
+static int emit_word(struct rpncalc_compiler* compiler, struct rpncalc_program* program);
+static int compile(struct rpncalc* calc, const char* text, struct rpncalc_program** programp);
+static int charge(struct rpncalc_run* state, long steps);
+static void accumulate(double* sum, double* error, double value);
+static struct rpncalc_window* new_window(int size, int node);
+static void free_window(struct rpncalc_window* window);
+static void window_add(struct rpncalc_window* window, double value, int sign);
+static void window_push(struct rpncalc_window* window, double value);
+static double window_sum(struct rpncalc_window* window);
+static int window_stat(struct rpncalc_window* window, int stat, double* valuep);
+static void accum_push(struct rpncalc_accum* accum, double value);
+static void accum_merge(struct rpncalc_accum* dst, struct rpncalc_accum* src);
+static int accum_stat(struct rpncalc_accum* accum, int stat, double* valuep);
+static double power_of_two(int exponent);
+static double logarithm(double x);
+static double exponential(double x);
+static void store_add(struct rpncalc_store* store, int index, u64 count);
+static void store_merge(struct rpncalc_store* dst, struct rpncalc_store* src);
+static void quantile_push(struct rpncalc_quantile* sketch, double value);
+static void quantile_merge(struct rpncalc_quantile* dst, struct rpncalc_quantile* src);
+static int quantile_stat(struct rpncalc_quantile* sketch, int stat, double* valuep);
+static double quantile_value(struct rpncalc_quantile* sketch, double q);
+static u64 hash_value(double value);
+static void hll_push(struct rpncalc_hll* hll, double value);
+static void hll_merge(struct rpncalc_hll* dst, struct rpncalc_hll* src);
+static int hll_stat(struct rpncalc_hll* hll, int stat, double* valuep);
+static void fold(struct rpncalc* calc, double value);
+static int run(struct rpncalc* calc, struct rpncalc_program* program, struct rpncalc_run* state);
+static int before(double a, double b);
+static void sift(double* values, int root, int count);
+static void heap_sort(double* values, int count, struct rpncalc_run* state);
+static void insertion_sort(double* values, int count);
+static int partition(double* values, int count, struct rpncalc_run* state);
+static void sort_values(double* values, int count, struct rpncalc_run* state);
+static void select_value(double* values, int count, int rank, struct rpncalc_run* state);
+static double smallest(double* values, int count);
+static void vector_begin(void);
+static void vector_end(void);
+static void prefix_sum_generic(double* values, int count, double carry);
+static double dot_product_generic(const double* x, const double* y, int count);
+static void prefix_sum_float_generic(float* values, int count, float carry);
+static float dot_product_float_generic(const float* x, const float* y, int count);
+static double polynomial_generic(const double* coefficients, int count, double x, double carry);
+static double polynomial(const double* coefficients, int count, double x);
+static int matrix_size(int rows, int cols, int* sizep);
+static void matrix_tile_generic(const double* a, const double* b, double* c, int rows, int inner, int cols, int astride, int stride);
+static void matrix_multiply(const double* a, const double* b, double* c, int rows, int inner, int cols, struct rpncalc_run* state);
+static void select_kernels(void);
+static void matrix_transpose(const double* m, double* t, int rows, int cols);
+static int eliminate(double* a, double* b, int n, int cols, double* detp, struct rpncalc_run* state);
+static void back_substitute(const double* u, double* b, int n, int cols, struct rpncalc_run* state);
+static int lock_top(int handle, int count, int types, struct rpncalc** calcp);
+static double square_root(double x);
+static double magnitude(double re, double im);
+static double arctangent(double y, double x);
+static int sign_bit(double x);
+static int lock_integers(int handle, struct rpncalc** calcp);
+static int lock_stack(struct rpncalc* calc);
+static void put_bits(u64* words, size_t* bitp, u64 value, int count);
+static u64 get_bits(const u64* words, size_t* bitp, int count);
+static size_t encode_words(u64* packed, const u64* words, size_t count, int stride);
+static void decode_words(u64* words, const u64* packed, size_t count, int stride);
+static void follow_node(struct rpncalc* calc);
+static void publish(struct rpncalc* calc, double value);
+static int start_log(struct rpncalc* calc);
+static void log_change(struct rpncalc* calc, int kind, int count, double value);
+static void log_rewrite(struct rpncalc* calc, int from, int old);
+static void pack(struct rpncalc* calc);
+static int unpack(struct rpncalc* calc);
+static int eight_digits(const char* p);
+static u32 parse_eight(const char* p);
+static u64 eisel_lemire(u64 w, int q);
+static u64 round_digits(const char* p, const char* end, int explicit, u64 lower);
+static void big_muladd(u32* big, int* lenp, u32 mul, u32 add);
+static void big_pow5(u32* big, int* lenp, int n);
+static void big_shift(u32* big, int* lenp, int bits);
+static int big_compare(const u32* a, int alen, const u32* b, int blen);
+static const char* skip_separators(const char* p, const char* end);
+static int pow5_bits(int e);
+static int pow5_factor(u64 value);
+static u64 mul_shift(u64 m, const u64* mul, int j);
+static u64 shortest(u64 bits, int* exponentp);
+static int encode_xor(u8* out, u64 x, int width);
+static int decode_xor(u64* xp, const u8* in, int len, int width);
+static int encode_value(u8* out, const struct rpncalc_ops* ops, const void* data, int index);
+static int decode_value(void* data, int index, const struct rpncalc_ops* ops, const u8* in, int len);
+static const char* find_separator(const char* p, const char* end);
+static void to_digits(u32* digits, u128 value);
+static u128 from_digits(const u32* digits);
+static void multiply_digits(u32* product, u128 a, u128 b);
+static void divide_digits(u32* quotient, u32* remainder, const u32* dividend, int m, const u32* divisor, int n);
+static u128 divide_wide(u32* quotient, const u32* dividend, u128 divisor, int round);
+static int to_signed(const u32* magnitude, int negative, s128* resultp);
+static int integer_multiply(s128 a, s128 b, u128 scale, s128* resultp);
+static int integer_divide(s128 a, s128 b, u128 scale, s128* resultp);
+static int integer_remainder(s128 a, s128 b, s128* resultp);
+static struct rpncalc_complex complex_product(struct rpncalc_complex a, struct rpncalc_complex b);
+static struct rpncalc_complex complex_quotient(struct rpncalc_complex a, struct rpncalc_complex b);
+static struct rpncalc_complex complex_unary(char op, struct rpncalc_complex a);
+
+// Bulk kernels, pointed at the best implementation for the CPU when the
+// module loads. See rpncalc_kernels.h.
+DEFINE_STATIC_CALL(rpncalc_prefix_sum, prefix_sum_generic);
+DEFINE_STATIC_CALL(rpncalc_dot_product, dot_product_generic);
+DEFINE_STATIC_CALL(rpncalc_prefix_sum_float, prefix_sum_float_generic);
+DEFINE_STATIC_CALL(rpncalc_dot_product_float, dot_product_float_generic);
+DEFINE_STATIC_CALL(rpncalc_polynomial, polynomial_generic);
+DEFINE_STATIC_CALL(rpncalc_matrix_tile, matrix_tile_generic);
+
+// Operator on the top two values of a stack, which cannot fail. Written as
+// plain C on the stack's own type: + - * / of floats are correctly rounded,
+// the same as computing in double and rounding once.
+#define DEFINE_BINARY(name, ctype, op, expr)							\
+static int name##_##op(void* data, int size) {							\
+	ctype* values = data;												\
+	ctype op2 = values[size - 2];										\
+	ctype op1 = values[size - 1];										\
+																		\
+	values[size - 2] = (expr);											\
+																		\
+	return RPNCALC_E_SUCCESS;											\
+}
+
+// Operator on the top two values of a stack that can fail, whose expr
+// stores into result and gives an error code. The values are left alone
+// unless it succeeds.
+#define DEFINE_CHECKED_BINARY(name, ctype, op, expr)					\
+static int name##_##op(void* data, int size) {							\
+	ctype* values = data;												\
+	ctype op2 = values[size - 2];										\
+	ctype op1 = values[size - 1];										\
+	ctype result;														\
+	int retval = (expr);												\
+																		\
+	if(retval == RPNCALC_E_SUCCESS) {									\
+		values[size - 2] = result;										\
+	}																	\
+																		\
+	return retval;														\
+}
+
+// All operations of a real stack type held as ctype, with the bulk kernels
+// behind the given static calls.
+#define DEFINE_REAL_OPS(name, ctype, type_, prefix_sum_call, dot_product_call)	\
+static double name##_get(const void* data, int index) {					\
+	return ((const ctype*)data)[index];									\
+}																		\
+																		\
+static void name##_set(void* data, int index, double value) {			\
+	((ctype*)data)[index] = value;										\
+}																		\
+																		\
+DEFINE_BINARY(name, ctype, add, op2 + op1)								\
+DEFINE_BINARY(name, ctype, subtract, op2 - op1)							\
+DEFINE_BINARY(name, ctype, multiply, op2 * op1)							\
+DEFINE_BINARY(name, ctype, divide, op2 / op1)							\
+DEFINE_BINARY(name, ctype, less, op2 < op1)								\
+DEFINE_BINARY(name, ctype, less_equal, op2 <= op1)						\
+DEFINE_BINARY(name, ctype, greater, op2 > op1)							\
+DEFINE_BINARY(name, ctype, greater_equal, op2 >= op1)					\
+DEFINE_BINARY(name, ctype, equal, op2 == op1)							\
+DEFINE_BINARY(name, ctype, not_equal, op2 != op1)						\
+																		\
+static void name##_select(void* data, int size) {						\
+	ctype* values = data;												\
+																		\
+	/* A conditional expression compiles to a compare and conditional	\
+	   move or blend rather than a branch. */							\
+	values[size - 3] = values[size - 3] != 0 ? values[size - 2] : values[size - 1];	\
+}																		\
+																		\
+static void name##_prefix_sum(void* data, int index, int count) {		\
+	ctype* values = (ctype*)data + index;								\
+	int done;															\
+	int n;																\
+																		\
+	/* Sum a chunk at a time, each in its own FPU section, carrying the	\
+	   total of one chunk into the next. */								\
+	for(done = 0; done < count; done += n) {							\
+		n = min(count - done, RPNCALC_VECTOR_CHUNK);					\
+		vector_begin();													\
+		static_call(prefix_sum_call)(values + done, n, done ? values[done - 1] : 0);	\
+		vector_end();													\
+		cond_resched();													\
+	}																	\
+}																		\
+																		\
+static double name##_dot_product(const void* data, int index, int count) {	\
+	const ctype* values = (const ctype*)data + index;					\
+	double sum = 0;														\
+	int done;															\
+	int n;																\
+																		\
+	/* Add up the products a chunk at a time, each in its own FPU		\
+	   section. */														\
+	for(done = 0; done < count; done += n) {							\
+		n = min(count - done, RPNCALC_VECTOR_CHUNK);					\
+		vector_begin();													\
+		sum += static_call(dot_product_call)(values + done, values + count + done, n);	\
+		vector_end();													\
+		cond_resched();													\
+	}																	\
+																		\
+	return sum;															\
+}																		\
+																		\
+static const struct rpncalc_ops name##_ops = {							\
+	.type = type_,														\
+	.width = sizeof(ctype),												\
+	.get = name##_get,													\
+	.set = name##_set,													\
+	.binary = {															\
+		[OP_ADD] = name##_add,											\
+		[OP_SUBTRACT] = name##_subtract,								\
+		[OP_MULTIPLY] = name##_multiply,								\
+		[OP_DIVIDE] = name##_divide,									\
+		[OP_LESS] = name##_less,										\
+		[OP_LESS_EQUAL] = name##_less_equal,							\
+		[OP_GREATER] = name##_greater,									\
+		[OP_GREATER_EQUAL] = name##_greater_equal,						\
+		[OP_EQUAL] = name##_equal,										\
+		[OP_NOT_EQUAL] = name##_not_equal,								\
+	},																	\
+	.select = name##_select,											\
+	.prefix_sum = name##_prefix_sum,									\
+	.dot_product = name##_dot_product,									\
+}
+
+// Operations of a complex stack, the binary operators of rpncalc_cop.
+#define DEFINE_COMPLEX_OPS(name, type_)									\
+DEFINE_BINARY(name, struct rpncalc_complex, add, ((struct rpncalc_complex){ op2.re + op1.re, op2.im + op1.im }))	\
+DEFINE_BINARY(name, struct rpncalc_complex, subtract, ((struct rpncalc_complex){ op2.re - op1.re, op2.im - op1.im }))	\
+DEFINE_BINARY(name, struct rpncalc_complex, multiply, complex_product(op2, op1))	\
+DEFINE_BINARY(name, struct rpncalc_complex, divide, complex_quotient(op2, op1))	\
+																		\
+static const struct rpncalc_ops name##_ops = {							\
+	.type = type_,														\
+	.width = sizeof(struct rpncalc_complex),							\
+	.binary = {															\
+		[OP_ADD] = name##_add,											\
+		[OP_SUBTRACT] = name##_subtract,								\
+		[OP_MULTIPLY] = name##_multiply,								\
+		[OP_DIVIDE] = name##_divide,									\
+	},																	\
+}
+
+// Operations of a stack of 128-bit integers counting units of 1 / scale,
+// the operators of rpncalc_iop. A constant scale of 1 drops the rescaling
+// from the generated code.
+#define DEFINE_INTEGER_OPS(name, type_, scale)							\
+DEFINE_CHECKED_BINARY(name, s128, add, check_add_overflow(op2, op1, &result) ? RPNCALC_E_OVERFLOW : RPNCALC_E_SUCCESS)	\
+DEFINE_CHECKED_BINARY(name, s128, subtract, check_sub_overflow(op2, op1, &result) ? RPNCALC_E_OVERFLOW : RPNCALC_E_SUCCESS)	\
+DEFINE_CHECKED_BINARY(name, s128, multiply, integer_multiply(op2, op1, scale, &result))	\
+DEFINE_CHECKED_BINARY(name, s128, divide, integer_divide(op2, op1, scale, &result))	\
+DEFINE_CHECKED_BINARY(name, s128, remainder, integer_remainder(op2, op1, &result))	\
+																		\
+static const struct rpncalc_ops name##_ops = {							\
+	.type = type_,														\
+	.width = sizeof(s128),												\
+	.binary = {															\
+		[OP_ADD] = name##_add,											\
+		[OP_SUBTRACT] = name##_subtract,								\
+		[OP_MULTIPLY] = name##_multiply,								\
+		[OP_DIVIDE] = name##_divide,									\
+		[OP_REMAINDER] = name##_remainder,								\
+	},																	\
+}
+
+DEFINE_REAL_OPS(double, double, TYPE_DOUBLE, rpncalc_prefix_sum, rpncalc_dot_product);
+DEFINE_REAL_OPS(float, float, TYPE_FLOAT, rpncalc_prefix_sum_float, rpncalc_dot_product_float);
+DEFINE_COMPLEX_OPS(complex, TYPE_COMPLEX);
+DEFINE_INTEGER_OPS(int128, TYPE_INT128, 1);
+DEFINE_INTEGER_OPS(decimal, TYPE_DECIMAL, RPNCALC_DECIMAL_ONE);
 
 /**
  *	rpncalc_new - Allocate a new calculator.
@@ -45,40 +629,354 @@ int	rpncalc_new(int* handlep) {
 		return RPNCALC_E_INVALID;
 	}
 
-	// Allocate memory for calculator.
-	calc = kmalloc(sizeof(struct rpncalc), GFP_KERNEL);
+	// Allocate the calculator.
+	calc = create_rpncalc(numa_node_id());
 	if(!calc) {
 		return RPNCALC_E_NOMEM;
 	}
 
-	// Initialize the calculator.
-	calc->handle = next_handle++;
-	INIT_LIST_HEAD(&calc->stack);
-	mutex_init(&calc->lock);
+	// Insert calculator into table and return its handle.
+	insert_rpncalc(calc, handlep);
 
-	// Lock the calculator table.
-	mutex_lock(&calcs_lock);
+	// Return success.
+	return RPNCALC_E_SUCCESS;
+}
 
-	// Insert calculator into table.
-	hash_add(calcs, &calc->next, calc->handle);
+/**
+ *	rpncalc_new_window - Allocate a new sliding window calculator.
+ *	@size - number of most recent values in the window
+ *	@handlep - pointer to return calculator handle with
+ *
+ *	Values pushed with rpncalc_push are added to the window instead of the
+ *	stack, evicting the oldest value once the window is full. Each push
+ *	updates the window sum, minimum and maximum in amortized O(1) time,
+ *	and rpncalc_stat reads them without scanning the window. Infinities and
+ *	NaNs are counted apart from the sum, so it recovers once they leave;
+ *	only a sum of finite values that overflows is recomputed by a scan.
+ *
+ *	The window keeps no stack: rpncalc_pop, rpncalc_op, rpncalc_eval,
+ *	registers and every other function that works on the stack return
+ *	RPNCALC_E_INVALID for it.
+ */
+int rpncalc_new_window(int size, int* handlep) {
+	struct rpncalc* calc;
 
-	// Assign calculator handle to return pointer.
-	*handlep = calc->handle;
+	// Make sure size and handlep are valid.
+	if(size <= 0 || !handlep) {
+		return RPNCALC_E_INVALID;
+	}
 
-	// Unlock the calculator table.
-	mutex_unlock(&calcs_lock);
+	// Allocate the calculator.
+	calc = create_rpncalc(numa_node_id());
+	if(!calc) {
+		return RPNCALC_E_NOMEM;
+	}
+
+	// Allocate the window on the calculator's node.
+	calc->window = new_window(size, calc->node);
+	if(!calc->window) {
+		kfree(calc);
+		return RPNCALC_E_NOMEM;
+	}
+	calc->kind = KIND_WINDOW;
+
+	// Insert calculator into table and return its handle.
+	insert_rpncalc(calc, handlep);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_new_accum - Allocate a new accumulator calculator.
+ *	@alpha - smoothing factor of the exponential moving average, in (0, 1]
+ *	@handlep - pointer to return calculator handle with
+ *
+ *	Values pushed with rpncalc_push are folded into constant size running
+ *	statistics instead of being kept on the stack: count, mean and
+ *	variance (Welford's method), minimum, maximum and an exponential
+ *	moving average. Read them with rpncalc_stat, and combine accumulators
+ *	with rpncalc_merge. Like a window, an accumulator keeps no stack, so
+ *	stack functions return RPNCALC_E_INVALID for it.
+ */
+int rpncalc_new_accum(double alpha, int* handlep) {
+	struct rpncalc* calc;
+
+	// Make sure alpha and handlep are valid.
+	if(!(alpha > 0 && alpha <= 1) || !handlep) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Allocate the calculator.
+	calc = create_rpncalc(numa_node_id());
+	if(!calc) {
+		return RPNCALC_E_NOMEM;
+	}
+
+	// Allocate the statistics on the calculator's node.
+	calc->accum = kzalloc_node(sizeof(struct rpncalc_accum), GFP_KERNEL_ACCOUNT, calc->node);
+	if(!calc->accum) {
+		kfree(calc);
+		return RPNCALC_E_NOMEM;
+	}
+	calc->accum->alpha = alpha;
+	calc->kind = KIND_ACCUM;
+
+	// Insert calculator into table and return its handle.
+	insert_rpncalc(calc, handlep);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_new_quantile - Allocate a new quantile sketch calculator.
+ *	@accuracy - relative accuracy of quantiles, from RPNCALC_SKETCH_ACCURACY
+ *	up to but not including 1
+ *	@handlep - pointer to return calculator handle with
+ *
+ *	Values pushed with rpncalc_push are counted in a DDSketch: logarithmic
+ *	buckets whose bounds differ by a factor of (1 + accuracy) / (1 -
+ *	accuracy), so any quantile read with rpncalc_quantile is within
+ *	@accuracy of a true value. Memory is fixed at RPNCALC_SKETCH_BINS
+ *	buckets per sign; if the values of one sign span more buckets, its
+ *	buckets nearest zero are merged. That keeps the largest magnitudes
+ *	accurate, so high quantiles of positive values and low quantiles of
+ *	negative ones, while quantiles that fall among negative values close to
+ *	zero may lose accuracy. Infinities and NaNs are ignored. Sketches with
+ *	the same accuracy can be merged with rpncalc_merge. The sketch keeps
+ *	no stack, so stack functions return RPNCALC_E_INVALID for it.
+ */
+int rpncalc_new_quantile(double accuracy, int* handlep) {
+	struct rpncalc* calc;
+	struct rpncalc_quantile* sketch;
+
+	// Make sure accuracy and handlep are valid. Finer accuracy would put
+	// the bucket indexes of the smallest and largest doubles out of the
+	// range of an int.
+	if(!(accuracy >= RPNCALC_SKETCH_ACCURACY && accuracy < 1) || !handlep) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Allocate the calculator.
+	calc = create_rpncalc(numa_node_id());
+	if(!calc) {
+		return RPNCALC_E_NOMEM;
+	}
+
+	// Allocate the sketch on the calculator's node.
+	sketch = kvzalloc_node(sizeof(struct rpncalc_quantile), GFP_KERNEL_ACCOUNT, calc->node);
+	if(!sketch) {
+		kfree(calc);
+		return RPNCALC_E_NOMEM;
+	}
+	sketch->accuracy = accuracy;
+	sketch->gamma = (1 + accuracy) / (1 - accuracy);
+	sketch->lngamma = logarithm(sketch->gamma);
+	calc->quantile = sketch;
+	calc->kind = KIND_QUANTILE;
+
+	// Insert calculator into table and return its handle.
+	insert_rpncalc(calc, handlep);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_new_distinct - Allocate a new distinct count calculator.
+ *	@handlep - pointer to return calculator handle with
+ *
+ *	Values pushed with rpncalc_push are hashed into a HyperLogLog sketch
+ *	of 2^RPNCALC_HLL_BITS registers, and RPNCALC_STAT_DISTINCT estimates
+ *	the number of distinct values with a standard error of about 1.6%.
+ *	Sketches can be merged with rpncalc_merge. The sketch keeps no stack,
+ *	so stack functions return RPNCALC_E_INVALID for it.
+ */
+int rpncalc_new_distinct(int* handlep) {
+	struct rpncalc* calc;
+
+	// Make sure handlep is valid.
+	if(!handlep) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Allocate the calculator.
+	calc = create_rpncalc(numa_node_id());
+	if(!calc) {
+		return RPNCALC_E_NOMEM;
+	}
+
+	// Allocate the sketch on the calculator's node.
+	calc->hll = kzalloc_node(sizeof(struct rpncalc_hll), GFP_KERNEL_ACCOUNT, calc->node);
+	if(!calc->hll) {
+		kfree(calc);
+		return RPNCALC_E_NOMEM;
+	}
+	calc->kind = KIND_DISTINCT;
+
+	// Insert calculator into table and return its handle.
+	insert_rpncalc(calc, handlep);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_new_complex - Allocate a new complex number calculator.
+ *	@handlep - pointer to return calculator handle with
+ *
+ *	The stack holds complex numbers, which are pushed, popped and operated
+ *	on with the _complex functions and rpncalc_cop. The double stack
+ *	functions fail with RPNCALC_E_INVALID.
+ */
+int rpncalc_new_complex(int* handlep) {
+	struct rpncalc* calc;
+
+	// Make sure handlep is valid.
+	if(!handlep) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Allocate the calculator.
+	calc = create_rpncalc(numa_node_id());
+	if(!calc) {
+		return RPNCALC_E_NOMEM;
+	}
+	calc->ops = &complex_ops;
+
+	// Insert calculator into table and return its handle.
+	insert_rpncalc(calc, handlep);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_new_int128 - Allocate a new 128-bit integer calculator.
+ *	@handlep - pointer to return calculator handle with
+ *
+ *	The stack holds signed 128-bit integers, which are pushed, popped and
+ *	operated on with the _int functions and rpncalc_iop. Arithmetic is
+ *	exact, and fails with RPNCALC_E_OVERFLOW instead of wrapping.
+ */
+int rpncalc_new_int128(int* handlep) {
+	struct rpncalc* calc;
+
+	// Make sure handlep is valid.
+	if(!handlep) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Allocate the calculator.
+	calc = create_rpncalc(numa_node_id());
+	if(!calc) {
+		return RPNCALC_E_NOMEM;
+	}
+	calc->ops = &int128_ops;
+
+	// Insert calculator into table and return its handle.
+	insert_rpncalc(calc, handlep);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_new_decimal - Allocate a new decimal fixed-point calculator.
+ *	@handlep - pointer to return calculator handle with
+ *
+ *	Like an integer calculator, but values are in units of
+ *	10^-RPNCALC_DECIMAL_DIGITS, so pushing 1500000000000000000 pushes 1.5.
+ *	Products and quotients are rounded to the nearest unit, ties to even.
+ */
+int rpncalc_new_decimal(int* handlep) {
+	struct rpncalc* calc;
+
+	// Make sure handlep is valid.
+	if(!handlep) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Allocate the calculator.
+	calc = create_rpncalc(numa_node_id());
+	if(!calc) {
+		return RPNCALC_E_NOMEM;
+	}
+	calc->ops = &decimal_ops;
+
+	// Insert calculator into table and return its handle.
+	insert_rpncalc(calc, handlep);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_new_float - Allocate a new single precision calculator.
+ *	@handlep - pointer to return calculator handle with
+ *
+ *	The stack holds floats, for values that only need about 7 significant
+ *	digits, in half the memory. rpncalc_push, rpncalc_pop, rpncalc_at,
+ *	rpncalc_op, rpncalc_sto and rpncalc_rcl take and return doubles,
+ *	converting at the boundary, and rpncalc_cumsum and rpncalc_dot work on
+ *	the floats directly. Other stack functions fail with
+ *	RPNCALC_E_INVALID.
+ */
+int rpncalc_new_float(int* handlep) {
+	struct rpncalc* calc;
+
+	// Make sure handlep is valid.
+	if(!handlep) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Allocate the calculator.
+	calc = create_rpncalc(numa_node_id());
+	if(!calc) {
+		return RPNCALC_E_NOMEM;
+	}
+	calc->ops = &float_ops;
+
+	// Insert calculator into table and return its handle.
+	insert_rpncalc(calc, handlep);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_new_on_node - Allocate a new calculator on a NUMA node.
+ *	@node - node to allocate the calculator and its stack on
+ *	@handlep - pointer to return calculator handle with
+ *
+ *	Like rpncalc_new, which allocates on the node of the calling CPU. The
+ *	stack stays on @node unless the migrate_accesses module parameter
+ *	lets it follow the CPUs using it.
+ */
+int rpncalc_new_on_node(int node, int* handlep) {
+	struct rpncalc* calc;
+
+	// Make sure handlep and node are valid.
+	if(!handlep || node < 0 || node >= nr_node_ids || !node_online(node)) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Allocate the calculator.
+	calc = create_rpncalc(node);
+	if(!calc) {
+		return RPNCALC_E_NOMEM;
+	}
+
+	// Insert calculator into table and return its handle.
+	insert_rpncalc(calc, handlep);
 
-	// Return success.
 	return RPNCALC_E_SUCCESS;
 }
 
 /**
  *	rpncalc_delete - Free a calculator.
  *  @handle: handle of calculator
+ *
+ *	The handle stops working at once and subscribers stop receiving
+ *	results. Calls already using the calculator finish first, and it is
+ *	freed when the last of them returns.
  */
 int rpncalc_delete(int handle) {
 	struct rpncalc* calc;
-	struct rpncalc_entry* entry;
+	struct rpncalc_subscriber* sub;
 
 	// Lock the calculator table.
 	mutex_lock(&calcs_lock);
@@ -96,18 +994,18 @@ int rpncalc_delete(int handle) {
 	// Unlock the calculator table.
 	mutex_unlock(&calcs_lock);
 
-	// Lock the calculator.
+	// End the subscriptions. Each subscriber holds a reference until it
+	// unsubscribes.
 	mutex_lock(&calc->lock);
-
-	// Free the stack entries.
-	while(!list_empty(&calc->stack)) {
-		entry = list_first_entry(&calc->stack, struct rpncalc_entry, next);
-		list_del(&entry->next);
-		kfree(entry);
+	while(!list_empty(&calc->subscribers)) {
+		sub = list_first_entry(&calc->subscribers, struct rpncalc_subscriber, next);
+		list_del_init(&sub->next);
 	}
+	mutex_unlock(&calc->lock);
 
-	// Free the rpncalc.
-	kfree(calc);
+	// Drop the reference from the lookup and the one the table held.
+	put_rpncalc(calc);
+	put_rpncalc(calc);
 
 	return RPNCALC_E_SUCCESS;
 }
@@ -116,10 +1014,12 @@ int rpncalc_delete(int handle) {
  *	rpncalc_push - Push a value onto the calculator stack.
  *	@handle - handle of calculator
  *	@value - value to push
+ *
+ *	Window, accumulator and sketch calculators fold the value into their
+ *	window, statistics or sketch instead.
  */
 int rpncalc_push(int handle, double value) {
 	struct rpncalc* calc;
-	struct rpncalc_entry* entry;
 	int retval;
 
 	// Lock the calculator table.
@@ -135,23 +1035,28 @@ int rpncalc_push(int handle, double value) {
 	// Unlock the calculator table.
 	mutex_unlock(&calcs_lock);
 
-	// Create a new entry.
-	entry = new_entry();
-	if(!entry) {
-		return RPNCALC_E_NOMEM;
+	// Fold the value into calculators that do not keep it on the stack.
+	if(calc->kind != KIND_STACK) {
+		mutex_lock(&calc->lock);
+		fold(calc, value);
+		unlock_rpncalc(calc);
+		return RPNCALC_E_SUCCESS;
 	}
 
-	// Set value in entry.
-	entry->value = value;
-
-	// Lock the calculator.
-	mutex_lock(&calc->lock);
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
 
-	// Push the entry onto the stack.
-	retval = push(calc, entry);
+	// Push the value onto the stack.
+	retval = push(calc, value);
+	if(retval == RPNCALC_E_SUCCESS) {
+		log_rewrite(calc, calc->size - 1, calc->size - 1);
+	}
 
 	// Unlock the calculator.
-	mutex_unlock(&calc->lock);
+	unlock_rpncalc(calc);
 
 	return retval;
 }
@@ -163,7 +1068,6 @@ int rpncalc_push(int handle, double value) {
  */
 int rpncalc_pop(int handle, double* valuep) {
 	struct rpncalc* calc;
-	struct rpncalc_entry* entry;
 	int retval;
 
 	// Lock the calculator table.
@@ -179,38 +1083,39 @@ int rpncalc_pop(int handle, double* valuep) {
 	// Unlock the calculator table.
 	mutex_unlock(&calcs_lock);
 
-	// Lock the calculator.
-	mutex_lock(&calc->lock);
-
-	// Pop the calculator stack.
-	retval = pop(calc, &entry);
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
 	if(retval != RPNCALC_E_SUCCESS) {
-		mutex_unlock(&calc->lock);
 		return retval;
 	}
 
-	// Unlock the calculator.
-	mutex_unlock(&calc->lock);
-
-	// If valuep is valid, assign the entry value to return;
-	if(valuep) {
-		*valuep = entry->value;
+	// Pop the calculator stack.
+	retval = pop(calc, valuep);
+	if(retval == RPNCALC_E_SUCCESS) {
+		log_rewrite(calc, calc->size, calc->size + 1);
 	}
 
-	// Free the entry memory.
-	kfree(entry);
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
 
-	return RPNCALC_E_SUCCESS;
+	return retval;
 }
 
 /**
  *	rpncalc_op - Perform mathematical operation on calculator stack.
  *	@handle - handle of calculator
+ *	@op - one of '+', '-', '*', '/', '<', '>', '=' or '?'
  *	@valuep - optional pointer to return value with
+ *
+ *	Comparisons replace the top two values with 1 if the comparison holds
+ *	and 0 otherwise. '?' is select: it replaces the top three values with
+ *	the second from the top if the third from the top, the condition, is
+ *	non-zero and with the top value otherwise. So "c a b ?" gives a if c
+ *	holds and b if not.
  */
 int rpncalc_op(int handle, char op, double* valuep) {
 	struct rpncalc* calc;
-	struct rpncalc_entry* entry;
+	int old;
 	int retval;
 
 	// Lock the calculator table.
@@ -226,51 +1131,87 @@ int rpncalc_op(int handle, char op, double* valuep) {
 	// Unlock the calculator table.
 	mutex_unlock(&calcs_lock);
 
-	// Lock the calculator.
-	mutex_lock(&calc->lock);
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Complex and integer stacks have their own operator functions.
+	if(!(TYPE_BIT(calc->ops->type) & TYPES_REAL)) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
 
 	// Perform the operation.
+	old = calc->size;
 	switch(op) {
 		case '+':
 		{
-			retval = do_add(calc);
+			retval = do_binary(calc, OP_ADD);
 			break;
 		}
 		case '-':
 		{
-			retval = do_substract(calc);
+			retval = do_binary(calc, OP_SUBTRACT);
 			break;
 		}
 		case '*':
 		{
-			retval = do_multiply(calc);
+			retval = do_binary(calc, OP_MULTIPLY);
 			break;
 		}
 		case '/':
 		{
-			retval = do_divide(calc);
+			retval = do_binary(calc, OP_DIVIDE);
 			break;
 		}
-		default:
+		case '<':
 		{
-			return RPNCALC_E_INVALID;
+			retval = do_binary(calc, OP_LESS);
+			break;
 		}
-	}
+		case '>':
+		{
+			retval = do_binary(calc, OP_GREATER);
+			break;
+		}
+		case '=':
+		{
+			retval = do_binary(calc, OP_EQUAL);
+			break;
+		}
+		case '?':
+		{
+			retval = do_select(calc);
+			break;
+		}
+		default:
+		{
+			unlock_rpncalc(calc);
+			return RPNCALC_E_INVALID;
+		}
+	}
 
 	// If operation was not successful, return.
 	if(retval != RPNCALC_E_SUCCESS) {
-		mutex_unlock(&calc->lock);
+		unlock_rpncalc(calc);
 		return retval;
 	}
 
 	// If valuep is valid, get the top of the stack and return it.
 	if(valuep) {
-		entry = list_first_entry(&calc->stack, struct rpncalc_entry, next);
-		*valuep = entry->value;
+		*valuep = calc->ops->get(calc->data, calc->size - 1);
+	}
+	log_rewrite(calc, calc->size - 1, old);
+
+	// Hand the result to subscribers.
+	if(!list_empty(&calc->subscribers)) {
+		publish(calc, calc->ops->get(calc->data, calc->size - 1));
 	}
 
 	// Unlock the calculator.
-	mutex_unlock(&calc->lock);
+	unlock_rpncalc(calc);
 
 	return RPNCALC_E_SUCCESS;
 }
@@ -301,6 +1242,12 @@ int rpncalc_size(int handle, int* sizep) {
 	// Unlock the calculator table.
 	mutex_unlock(&calcs_lock);
 
+	// Only plain stacks have a size; see lock_stack.
+	if(calc->kind != KIND_STACK) {
+		put_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
 	// Lock the calculator.
 	mutex_lock(&calc->lock);
 
@@ -308,7 +1255,7 @@ int rpncalc_size(int handle, int* sizep) {
 	*sizep = calc->size;
 
 	// Unlock the calculator.
-	mutex_unlock(&calc->lock);
+	unlock_rpncalc(calc);
 
 	return RPNCALC_E_SUCCESS;
 }
@@ -321,8 +1268,7 @@ int rpncalc_size(int handle, int* sizep) {
  */
 int rpncalc_at(int handle, int index, double* valuep) {
 	struct rpncalc* calc;
-	struct rpncalc_entry* entry;
-	int i;
+	int retval;
 
 	// Make sure sizep is valid.
 	if(!valuep) {
@@ -335,237 +1281,5573 @@ int rpncalc_at(int handle, int index, double* valuep) {
 	// Look up calculator.
 	calc = get_rpncalc(handle);
 	if(!calc) {
+		mutex_unlock(&calcs_lock);
 		return RPNCALC_E_INVALID;
 	}
 
 	// Unlock the calculator table.
 	mutex_unlock(&calcs_lock);
 
-	// Make sure index is valid.
-	if(index < 0 || index >= calc->size) {
-		return RPNCALC_E_INVALID;
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
 	}
 
-	// Lock the calculator.
-	mutex_lock(&calc->lock);
-
-	// Iterate until we get to the index element.
-	entry = list_first_entry(&calc->stack, struct rpncalc_entry, next);
-	for(i = 0; i < index; i++) {
-		entry = list_next_entry(entry, next);
+	// Make sure the stack holds doubles or floats and index is valid.
+	if(!(TYPE_BIT(calc->ops->type) & TYPES_REAL) || index < 0 || index >= calc->size) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
 	}
 
-	// Get the value entry.
-	*valuep = entry->value;
+	// Index 0 is the top of the stack.
+	*valuep = calc->ops->get(calc->data, calc->size - 1 - index);
 
 	// Unlock the calculator.
-	mutex_unlock(&calc->lock);
+	unlock_rpncalc(calc);
 
 	return RPNCALC_E_SUCCESS;
 }
 
-static struct rpncalc* get_rpncalc(int handle) {
-	struct rpncalc* calc = 0;
-	struct rpncalc* cur;
+/**
+ *	rpncalc_register - Resolve a register name to its slot index.
+ *	@handle - handle of calculator
+ *	@name - name of register
+ *	@slotp - pointer to return slot index with
+ *
+ *	The register is allocated and set to zero the first time a name is
+ *	seen. The returned slot can be passed to rpncalc_sto and rpncalc_rcl
+ *	any number of times, so the name is only looked up once.
+ */
+int rpncalc_register(int handle, const char* name, int* slotp) {
+	struct rpncalc* calc;
+	struct rpncalc_register* reg;
+	int slot;
 
-	// Iterator over all rpncalcs in bucket mapped to by handle looking
-	// for rpncalc with handle we are looking for.
-	hash_for_each_possible(calcs, cur, next, handle){
-		if(cur->handle == handle) {
-			calc = cur;
-			break;
-		}
+	// Make sure name and slotp are valid.
+	if(!valid_name(name) || !slotp) {
+		return RPNCALC_E_INVALID;
 	}
 
-	return calc;
-}
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator.
+	mutex_lock(&calc->lock);
 
-static struct rpncalc_entry* new_entry() {
-	struct rpncalc_entry* entry;
+	// Look for an existing register with this name.
+	slot = find_register(calc, name);
+	if(slot < 0) {
+
+		// Fail if all registers are in use.
+		if(calc->nregisters == RPNCALC_REGISTERS) {
+			unlock_rpncalc(calc);
+			return RPNCALC_E_LIMIT;
+		}
 
-	// Allocate and initialize memory for entry.
-	entry = kmalloc(sizeof(struct rpncalc_entry), GFP_KERNEL);
-	if(entry) {
-		INIT_LIST_HEAD(&entry->next);
+		// Allocate the next free register.
+		slot = calc->nregisters++;
+		reg = &calc->registers[slot];
+		strscpy(reg->name, name, sizeof(reg->name));
+		reg->value = 0;
 	}
-	
-	return entry;
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	*slotp = slot;
+
+	return RPNCALC_E_SUCCESS;
 }
 
-static int push(struct rpncalc* calc, struct rpncalc_entry* entry) {
+/**
+ *	rpncalc_sto - Store the top of the stack in a register.
+ *	@handle - handle of calculator
+ *	@slot - register slot from rpncalc_register
+ *
+ *	The stack is left unchanged.
+ */
+int rpncalc_sto(int handle, int slot) {
+	struct rpncalc* calc;
+	int retval;
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
 
-	// Fail if entry is not valid.
-	if(!entry) {
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
 		return RPNCALC_E_INVALID;
 	}
 
-	// Add the entry to the stack and increment size.
-	list_add(&entry->next, &calc->stack);
-	calc->size++;
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
 
-	return RPNCALC_E_SUCCESS;
-}
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
 
-static int pop(struct rpncalc* calc, struct rpncalc_entry** entryp) {
+	// Make sure the stack holds doubles or floats and slot is valid.
+	if(!(TYPE_BIT(calc->ops->type) & TYPES_REAL) || slot < 0 || slot >= calc->nregisters) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
 
 	// Fail if the stack is empty.
 	if(calc->size == 0) {
+		unlock_rpncalc(calc);
 		return RPNCALC_E_INSUFFICIENT;
 	}
 
-	// Fail if return pointer is invalid.
-	if(!entryp) {
-		return RPNCALC_E_INVALID;
-	}
+	// Copy the top of the stack into the register.
+	calc->registers[slot].value = calc->ops->get(calc->data, calc->size - 1);
 
-	// Get the first entry in the stack, delete it, and decrement size.
-	*entryp = list_first_entry(&calc->stack, struct rpncalc_entry, next);
-	list_del(&(*entryp)->next);
-	calc->size--;
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
 
 	return RPNCALC_E_SUCCESS;
 }
 
-static int do_add(struct rpncalc* calc) {
-	struct rpncalc_entry* op1;
-	struct rpncalc_entry* op2;
-	struct rpncalc_entry* result;
+/**
+ *	rpncalc_rcl - Push the value of a register onto the stack.
+ *	@handle - handle of calculator
+ *	@slot - register slot from rpncalc_register
+ *	@valuep - optional pointer to return value with
+ */
+int rpncalc_rcl(int handle, int slot, double* valuep) {
+	struct rpncalc* calc;
 	int retval;
 
-	// Check that there are at least two entries on the stack.
-	if(calc->size < 2) {
-		return RPNCALC_E_INSUFFICIENT;
-	}
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
 
-	// Create a new entry for the result.
-	result = new_entry();
-	if(!result) {
-		return RPNCALC_E_NOMEM;
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
 	}
 
-	// Pop first operand off stack.
-	retval = pop(calc, &op1);
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
 	if(retval != RPNCALC_E_SUCCESS) {
 		return retval;
 	}
 
-	// Pop second operand off stack.
-	retval = pop(calc, &op2);
-	if(retval != RPNCALC_E_SUCCESS) {
-		return retval;
+	// Make sure slot is valid.
+	if(slot < 0 || slot >= calc->nregisters) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Push the register value.
+	retval = push(calc, calc->registers[slot].value);
+	if(retval == RPNCALC_E_SUCCESS) {
+		log_rewrite(calc, calc->size - 1, calc->size - 1);
 	}
 
-	// Add the two operands.
-	result->value = op2->value + op1->value;
+	// If valuep is valid, return the recalled value.
+	if(retval == RPNCALC_E_SUCCESS && valuep) {
+		*valuep = calc->registers[slot].value;
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
 
-	// Push the result back on the stack and return.
-	return push(calc, result);
+	return retval;
 }
 
-static int do_substract(struct rpncalc* calc) {
-	struct rpncalc_entry* op1;
-	struct rpncalc_entry* op2;
-	struct rpncalc_entry* result;
+/**
+ *	rpncalc_define - Compile and define a named word.
+ *	@handle - handle of calculator, or RPNCALC_GLOBAL
+ *	@name - name of word
+ *	@body - program text of word
+ *
+ *	The body is compiled and verified once. Words defined on a calculator
+ *	shadow global words of the same name, and may use that calculator's
+ *	registers; global words may not use registers. Words are bound when a
+ *	program using them is compiled, so redefining a word does not change
+ *	programs and words compiled earlier.
+ */
+int rpncalc_define(int handle, const char* name, const char* body) {
+	struct rpncalc* calc = 0;
+	struct rpncalc_word* word;
+	struct rpncalc_program* program;
+	struct list_head* list;
+	struct mutex* lock;
+	double value;
+	int nregisters = 0;
 	int retval;
+	int i;
 
-	// Check that there are at least two entries on the stack.
-	if(calc->size < 2) {
-		return RPNCALC_E_INSUFFICIENT;
+	// Make sure name and body are valid.
+	if(!valid_name(name) || !body) {
+		return RPNCALC_E_INVALID;
 	}
 
-	// Create a new entry for the result.
-	result = new_entry();
-	if(!result) {
-		return RPNCALC_E_NOMEM;
+	// Builtin names cannot be redefined, and names that read as numbers,
+	// such as inf and nan, could never be called.
+	for(i = 0; i < ARRAY_SIZE(builtins); i++) {
+		if(!strcmp(builtins[i].name, name)) {
+			return RPNCALC_E_INVALID;
+		}
+	}
+	if(parse_number(name, strlen(name), &value) == RPNCALC_E_SUCCESS) {
+		return RPNCALC_E_INVALID;
 	}
 
-	// Pop first operand off stack.
-	retval = pop(calc, &op1);
-	if(retval != RPNCALC_E_SUCCESS) {
-		return retval;
+	if(handle != RPNCALC_GLOBAL) {
+
+		// Lock the calculator table.
+		mutex_lock(&calcs_lock);
+
+		// Look up calculator.
+		calc = get_rpncalc(handle);
+		if(!calc) {
+			mutex_unlock(&calcs_lock);
+			return RPNCALC_E_INVALID;
+		}
+
+		// Unlock the calculator table.
+		mutex_unlock(&calcs_lock);
+
+		// Lock the calculator, noting the registers in use.
+		mutex_lock(&calc->lock);
+		nregisters = calc->nregisters;
+	}
+
+	// Compile the body.
+	retval = compile(calc, body, &program);
+
+	// The word must leave room for a caller. If it is not defined, free the
+	// registers its body allocated.
+	if(retval == RPNCALC_E_SUCCESS && program->depth >= RPNCALC_CALL_DEPTH) {
+		put_program(program);
+		retval = RPNCALC_E_LIMIT;
+		if(calc) {
+			calc->nregisters = nregisters;
+		}
 	}
 
-	// Pop second operand off stack.
-	retval = pop(calc, &op2);
 	if(retval != RPNCALC_E_SUCCESS) {
+		if(calc) {
+			unlock_rpncalc(calc);
+		}
 		return retval;
 	}
 
-	// Subtract the two operands.
-	result->value = op2->value - op1->value;
+	// Select the word list to define the word in.
+	if(calc) {
+		list = &calc->words;
+		lock = &calc->lock;
+	} else {
+		list = &words;
+		lock = &words_lock;
+		mutex_lock(lock);
+	}
+
+	// Replace an existing definition, or add a new word.
+	word = find_word(list, name, strlen(name));
+	if(word) {
+		put_program(word->program);
+	} else {
+		word = kmalloc(sizeof(struct rpncalc_word), GFP_KERNEL);
+		if(!word) {
+			retval = RPNCALC_E_NOMEM;
+			put_program(program);
+			if(calc) {
+				calc->nregisters = nregisters;
+			}
+			goto out;
+		}
+		strscpy(word->name, name, sizeof(word->name));
+		list_add(&word->next, list);
+	}
+	word->program = program;
+
+out:
+	// Unlock the word list.
+	if(calc) {
+		unlock_rpncalc(calc);
+	} else {
+		mutex_unlock(lock);
+	}
 
-	// Push the result back on the stack and return.
-	return push(calc, result);
+	return retval;
 }
 
-static int do_multiply(struct rpncalc* calc) {
-	struct rpncalc_entry* op1;
-	struct rpncalc_entry* op2;
-	struct rpncalc_entry* result;
-	int retval;
+/**
+ *	rpncalc_undefine - Remove a named word.
+ *	@handle - handle of calculator, or RPNCALC_GLOBAL
+ *	@name - name of word
+ *
+ *	Programs and words that already use the word keep working.
+ */
+int rpncalc_undefine(int handle, const char* name) {
+	struct rpncalc* calc = 0;
+	struct rpncalc_word* word;
+	struct list_head* list;
+	struct mutex* lock;
 
-	// Check that there are at least two entries on the stack.
-	if(calc->size < 2) {
-		return RPNCALC_E_INSUFFICIENT;
+	// Make sure name is valid.
+	if(!valid_name(name)) {
+		return RPNCALC_E_INVALID;
 	}
 
-	// Create a new entry for the result.
-	result = new_entry();
-	if(!result) {
-		return RPNCALC_E_NOMEM;
+	if(handle == RPNCALC_GLOBAL) {
+		list = &words;
+		lock = &words_lock;
+	} else {
+
+		// Lock the calculator table.
+		mutex_lock(&calcs_lock);
+
+		// Look up calculator.
+		calc = get_rpncalc(handle);
+		if(!calc) {
+			mutex_unlock(&calcs_lock);
+			return RPNCALC_E_INVALID;
+		}
+
+		// Unlock the calculator table.
+		mutex_unlock(&calcs_lock);
+
+		list = &calc->words;
+		lock = &calc->lock;
 	}
 
-	// Pop first operand off stack.
-	retval = pop(calc, &op1);
-	if(retval != RPNCALC_E_SUCCESS) {
-		return retval;
+	// Lock the word list.
+	mutex_lock(lock);
+
+	// Look up the word and remove it from the list.
+	word = find_word(list, name, strlen(name));
+	if(word) {
+		list_del(&word->next);
 	}
 
-	// Pop second operand off stack.
-	retval = pop(calc, &op2);
-	if(retval != RPNCALC_E_SUCCESS) {
-		return retval;
+	// Unlock the word list.
+	if(calc) {
+		unlock_rpncalc(calc);
+	} else {
+		mutex_unlock(lock);
 	}
 
-	// Multiply the two operands.
-	result->value = op2->value * op1->value;
+	// Free the word.
+	if(!word) {
+		return RPNCALC_E_INVALID;
+	}
+	put_program(word->program);
+	kfree(word);
 
-	// Push the result back on the stack and return.
-	return push(calc, result);
+	return RPNCALC_E_SUCCESS;
 }
 
-static int do_divide(struct rpncalc* calc) {
-	struct rpncalc_entry* op1;
-	struct rpncalc_entry* op2;
-	struct rpncalc_entry* result;
+/**
+ *	rpncalc_eval - Compile and run a program on the calculator stack.
+ *	@handle - handle of calculator
+ *	@expr - program text
+ *	@valuep - optional pointer to return top of stack with
+ *
+ *	Programs are whitespace separated tokens: numbers are pushed, "+ - * /"
+ *	operate on the stack, "< <= > >= = !=" compare giving 1 or 0, "select"
+ *	picks between two values like rpncalc_op's '?', "sto <name>" and
+ *	"rcl <name>" access registers,
+ *	and any other token invokes a word. "<cond> if ... [else ...] then"
+ *	runs a branch when the popped condition is non-zero, and "<n> do ...
+ *	loop" runs its body n times. Branches must leave the stack at the same
+ *	depth and loop bodies must leave it unchanged.
+ *
+ *	Register names and words are resolved while compiling, and the stack
+ *	depth is checked and room for the program reserved once before
+ *	running. A run that exceeds the calculator's instruction budget stops
+ *	with RPNCALC_E_LIMIT, leaving the stack as it was at that point.
+ *	@valuep is only written if the stack is not empty afterwards.
+ */
+int rpncalc_eval(int handle, const char* expr, double* valuep) {
+	struct rpncalc* calc;
+	struct rpncalc_program* program;
+	struct rpncalc_run state;
+	int old;
 	int retval;
 
-	// Check that there are at least two entries on the stack.
-	if(calc->size < 2) {
-		return RPNCALC_E_INSUFFICIENT;
+	// Make sure expr is valid.
+	if(!expr) {
+		return RPNCALC_E_INVALID;
 	}
 
-	// Create a new entry for the result.
-	result = new_entry();
-	if(!result) {
-		return RPNCALC_E_NOMEM;
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
 	}
 
-	// Pop first operand off stack.
-	retval = pop(calc, &op1);
+	// Compile the program.
+	retval = compile(calc, expr, &program);
 	if(retval != RPNCALC_E_SUCCESS) {
+		unlock_rpncalc(calc);
 		return retval;
 	}
 
-	// Pop second operand off stack.
-	retval = pop(calc, &op2);
+	// Make sure the stack holds doubles, is deep enough for the whole
+	// program, and has room for everything it pushes.
+	if(calc->ops->type != TYPE_DOUBLE) {
+		retval = RPNCALC_E_INVALID;
+	} else if(calc->size < program->needs) {
+		retval = RPNCALC_E_INSUFFICIENT;
+	} else {
+		retval = reserve(calc, program->peak);
+	}
 	if(retval != RPNCALC_E_SUCCESS) {
+		unlock_rpncalc(calc);
+		put_program(program);
 		return retval;
 	}
 
-	// Divide the two operands.
-	result->value = op2->value / op1->value;
+	// Run the program within the calculator's budget.
+	state.steps = 0;
+	state.budget = calc->budget;
+	state.resched = RPNCALC_RESCHED_STEPS;
+	old = calc->size;
+	retval = run(calc, program, &state);
+
+	// The program can only have changed the values it needs and above, even
+	// if it failed partway.
+	log_rewrite(calc, old - program->needs, old);
+
+	// If valuep is valid, get the top of the stack and return it.
+	if(retval == RPNCALC_E_SUCCESS && valuep && calc->size > 0) {
+		*valuep = calc->values[calc->size - 1];
+	}
+
+	// Hand the result to subscribers.
+	if(retval == RPNCALC_E_SUCCESS && calc->size > 0 && !list_empty(&calc->subscribers)) {
+		publish(calc, calc->ops->get(calc->data, calc->size - 1));
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	// Free the program.
+	put_program(program);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_set_budget - Set the instruction budget for program runs.
+ *	@handle - handle of calculator
+ *	@budget - maximum number of instructions per run
+ */
+int rpncalc_set_budget(int handle, long budget) {
+	struct rpncalc* calc;
+
+	// Make sure budget is valid.
+	if(budget <= 0) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator.
+	mutex_lock(&calc->lock);
+
+	// Set the budget.
+	calc->budget = budget;
 
-	// Push the result back on the stack and return.
-	return push(calc, result);
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_stat - Read a statistic of the values pushed to a calculator.
+ *	@handle - handle of calculator
+ *	@stat - RPNCALC_STAT_* statistic to read
+ *	@valuep - pointer to return value with
+ *
+ *	Only window, accumulator and sketch calculators keep statistics. All
+ *	but distinct count calculators keep the count, sum, mean, minimum and
+ *	maximum; only accumulators keep the variance and moving average, and
+ *	only distinct count calculators the distinct count. Statistics other
+ *	than the count, sum and distinct count fail with
+ *	RPNCALC_E_INSUFFICIENT until enough values have been pushed.
+ *
+ *	With RPNCALC_GLOBAL as @handle, reads a statistic of the module as a
+ *	whole instead, currently only RPNCALC_STAT_HUGE_STACKS.
+ */
+int rpncalc_stat(int handle, int stat, double* valuep) {
+	struct rpncalc* calc;
+	int retval;
+
+	// Make sure valuep is valid.
+	if(!valuep) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Module statistics need no calculator.
+	if(handle == RPNCALC_GLOBAL) {
+		if(stat != RPNCALC_STAT_HUGE_STACKS) {
+			return RPNCALC_E_INVALID;
+		}
+		*valuep = atomic_read(&huge_stacks);
+		return RPNCALC_E_SUCCESS;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator.
+	mutex_lock(&calc->lock);
+
+	// Read the statistic.
+	switch(calc->kind) {
+		case KIND_WINDOW:
+		{
+			retval = window_stat(calc->window, stat, valuep);
+			break;
+		}
+		case KIND_ACCUM:
+		{
+			retval = accum_stat(calc->accum, stat, valuep);
+			break;
+		}
+		case KIND_QUANTILE:
+		{
+			retval = quantile_stat(calc->quantile, stat, valuep);
+			break;
+		}
+		case KIND_DISTINCT:
+		{
+			retval = hll_stat(calc->hll, stat, valuep);
+			break;
+		}
+		default:
+		{
+			retval = RPNCALC_E_INVALID;
+			break;
+		}
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_merge - Merge the statistics of one calculator into another.
+ *	@handle - handle of calculator to merge into
+ *	@source - handle of calculator to merge from
+ *
+ *	Both calculators must be accumulators, quantile sketches with the same
+ *	accuracy, or distinct count sketches. The source is left unchanged.
+ *	The merged statistics are as if every value had been pushed to
+ *	@handle, so sketches kept per shard or per CPU can be combined. A
+ *	moving average depends on the order of values and cannot be merged, so
+ *	the destination keeps its own unless it had no values.
+ */
+int rpncalc_merge(int handle, int source) {
+	struct rpncalc* dst;
+	struct rpncalc* src;
+	int retval = RPNCALC_E_SUCCESS;
+
+	// A calculator cannot be merged into itself.
+	if(handle == source) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculators.
+	dst = get_rpncalc(handle);
+	src = get_rpncalc(source);
+	if(!dst || !src) {
+		mutex_unlock(&calcs_lock);
+		if(dst) {
+			put_rpncalc(dst);
+		}
+		if(src) {
+			put_rpncalc(src);
+		}
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock both calculators, lowest handle first.
+	lock_pair(dst, src);
+
+	// Merge the statistics or sketches.
+	if(dst->kind != src->kind) {
+		retval = RPNCALC_E_INVALID;
+	} else if(dst->kind == KIND_ACCUM) {
+		accum_merge(dst->accum, src->accum);
+	} else if(dst->kind == KIND_QUANTILE && dst->quantile->accuracy == src->quantile->accuracy) {
+		quantile_merge(dst->quantile, src->quantile);
+	} else if(dst->kind == KIND_DISTINCT) {
+		hll_merge(dst->hll, src->hll);
+	} else {
+		retval = RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculators.
+	unlock_rpncalc(src);
+	unlock_rpncalc(dst);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_quantile - Read a quantile from a quantile sketch calculator.
+ *	@handle - handle of calculator
+ *	@q - quantile to read, from 0 (minimum) to 1 (maximum)
+ *	@valuep - pointer to return value with
+ */
+int rpncalc_quantile(int handle, double q, double* valuep) {
+	struct rpncalc* calc;
+	int retval = RPNCALC_E_SUCCESS;
+
+	// Make sure q and valuep are valid.
+	if(!(q >= 0 && q <= 1) || !valuep) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator.
+	mutex_lock(&calc->lock);
+
+	// Read the quantile.
+	if(calc->kind != KIND_QUANTILE) {
+		retval = RPNCALC_E_INVALID;
+	} else if(!calc->quantile->positive.total && !calc->quantile->negative.total && !calc->quantile->zeros) {
+		retval = RPNCALC_E_INSUFFICIENT;
+	} else {
+		*valuep = quantile_value(calc->quantile, q);
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_sort - Sort the top of the stack in place.
+ *	@handle - handle of calculator
+ *	@count - number of values at the top of the stack to sort
+ *
+ *	The values are sorted so the largest ends up on top. NaNs sort above
+ *	every other value.
+ */
+int rpncalc_sort(int handle, int count) {
+	struct rpncalc* calc;
+	struct rpncalc_run state = { .budget = LONG_MAX, .resched = RPNCALC_RESCHED_STEPS };
+	int retval;
+
+	// Look up and lock the calculator, checking the stack holds count values.
+	retval = lock_top(handle, count, TYPE_BIT(TYPE_DOUBLE), &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Sort the values.
+	sort_values(calc->values + calc->size - count, count, &state);
+	log_rewrite(calc, calc->size - count, calc->size);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_select - Replace the top of the stack with its rank-th
+ *	smallest value.
+ *	@handle - handle of calculator
+ *	@count - number of values at the top of the stack to select from
+ *	@rank - rank of the value to select, from 0 (smallest) to count - 1
+ *	@valuep - pointer to return value with, or NULL
+ *
+ *	Runs in linear time on average, and O(count log count) at worst.
+ */
+int rpncalc_select(int handle, int count, int rank, double* valuep) {
+	struct rpncalc* calc;
+	struct rpncalc_run state = { .budget = LONG_MAX, .resched = RPNCALC_RESCHED_STEPS };
+	double* values;
+	int retval;
+
+	// Look up and lock the calculator, checking the stack holds count values.
+	retval = lock_top(handle, count, TYPE_BIT(TYPE_DOUBLE), &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure rank is valid.
+	if(rank < 0 || rank >= count) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Select the value, and leave it in place of the others.
+	values = calc->values + calc->size - count;
+	select_value(values, count, rank, &state);
+	values[0] = values[rank];
+	calc->size -= count - 1;
+	log_rewrite(calc, calc->size - 1, calc->size + count - 1);
+
+	// If valuep is valid, return the selected value.
+	if(valuep) {
+		*valuep = values[0];
+	}
+
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_percentile - Replace the top of the stack with a percentile
+ *	of its values.
+ *	@handle - handle of calculator
+ *	@count - number of values at the top of the stack
+ *	@q - percentile to compute, from 0 (smallest) to 1 (largest)
+ *	@valuep - pointer to return value with, or NULL
+ *
+ *	Percentiles between two values are linearly interpolated, so a @q of
+ *	0.5 gives the median.
+ */
+int rpncalc_percentile(int handle, int count, double q, double* valuep) {
+	struct rpncalc* calc;
+	struct rpncalc_run state = { .budget = LONG_MAX, .resched = RPNCALC_RESCHED_STEPS };
+	double* values;
+	double position;
+	double fraction;
+	double value;
+	int retval;
+	int rank;
+
+	// Make sure q is valid.
+	if(!(q >= 0 && q <= 1)) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Look up and lock the calculator, checking the stack holds count values.
+	retval = lock_top(handle, count, TYPE_BIT(TYPE_DOUBLE), &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Find the ranks on either side of the percentile.
+	position = q * (count - 1);
+	rank = (int)position;
+	fraction = position - rank;
+
+	// Select the lower value. Everything above it in the partially ordered
+	// values is at least as large, so the upper value is the smallest of
+	// those.
+	values = calc->values + calc->size - count;
+	select_value(values, count, rank, &state);
+	value = values[rank];
+	if(fraction > 0) {
+		value += fraction * (smallest(values + rank + 1, count - rank - 1) - value);
+	}
+
+	// Leave the percentile in place of the values.
+	values[0] = value;
+	calc->size -= count - 1;
+	log_rewrite(calc, calc->size - 1, calc->size + count - 1);
+
+	// If valuep is valid, return the percentile.
+	if(valuep) {
+		*valuep = value;
+	}
+
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_median - Replace the top of the stack with its median.
+ *	@handle - handle of calculator
+ *	@count - number of values at the top of the stack
+ *	@valuep - pointer to return value with, or NULL
+ *
+ *	The median of an even number of values is the mean of the middle two.
+ */
+int rpncalc_median(int handle, int count, double* valuep) {
+	return rpncalc_percentile(handle, count, 0.5, valuep);
+}
+
+/**
+ *	rpncalc_topk - Replace the top of the stack with its k largest values.
+ *	@handle - handle of calculator
+ *	@count - number of values at the top of the stack
+ *	@k - number of values to keep
+ *
+ *	The values kept are sorted with the largest on top.
+ */
+int rpncalc_topk(int handle, int count, int k) {
+	struct rpncalc* calc;
+	struct rpncalc_run state = { .budget = LONG_MAX, .resched = RPNCALC_RESCHED_STEPS };
+	double* values;
+	int retval;
+
+	// Look up and lock the calculator, checking the stack holds count values.
+	retval = lock_top(handle, count, TYPE_BIT(TYPE_DOUBLE), &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure k is valid.
+	if(k < 0 || k > count) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Partition the k largest values to the end, then sort just those.
+	values = calc->values + calc->size - count;
+	if(k > 0 && k < count) {
+		select_value(values, count, count - k, &state);
+	}
+	sort_values(values + count - k, k, &state);
+
+	// Move the k largest down over the rest.
+	memmove(values, values + count - k, k * sizeof(double));
+	calc->size -= count - k;
+	log_rewrite(calc, calc->size - k, calc->size - k + count);
+
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_cumsum - Replace the top of the stack with its running sums.
+ *	@handle - handle of double or float calculator
+ *	@count - number of values at the top of the stack
+ *
+ *	Each value becomes the sum of itself and every value below it within
+ *	the @count values, so the top ends up holding the total.
+ */
+int rpncalc_cumsum(int handle, int count) {
+	struct rpncalc* calc;
+	int retval;
+
+	// Look up and lock the calculator, checking the stack holds count values.
+	retval = lock_top(handle, count, TYPES_REAL, &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Sum the values in place.
+	calc->ops->prefix_sum(calc->data, calc->size - count, count);
+	log_rewrite(calc, calc->size - count, calc->size);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_dot - Replace two vectors at the top of the stack with their
+ *	dot product.
+ *	@handle - handle of double or float calculator
+ *	@count - number of values in each vector
+ *	@valuep - pointer to return value with, or NULL
+ *
+ *	The first vector is the @count values below the second, which is the
+ *	top @count values.
+ */
+int rpncalc_dot(int handle, int count, double* valuep) {
+	struct rpncalc* calc;
+	double value;
+	int base;
+	int retval;
+
+	// Make sure both vectors fit in a stack.
+	if(count > INT_MAX / 2) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Look up and lock the calculator, checking the stack holds both vectors.
+	retval = lock_top(handle, 2 * count, TYPES_REAL, &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Leave the dot product in place of the vectors.
+	base = calc->size - 2 * count;
+	value = calc->ops->dot_product(calc->data, base, count);
+	calc->ops->set(calc->data, base, value);
+	calc->size = base + 1;
+	log_rewrite(calc, base, base + 2 * count);
+
+	// If valuep is valid, return the dot product.
+	if(valuep) {
+		*valuep = calc->ops->get(calc->data, base);
+	}
+
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_horner - Replace a polynomial and its argument at the top of
+ *	the stack with its value.
+ *	@handle - handle of calculator
+ *	@count - number of coefficients
+ *	@valuep - pointer to return value with, or NULL
+ *
+ *	The argument is on top of the stack, and the @count coefficients are
+ *	below it with the highest degree deepest.
+ */
+int rpncalc_horner(int handle, int count, double* valuep) {
+	struct rpncalc* calc;
+	double* values;
+	int retval;
+
+	// Make sure count is valid.
+	if(count < 1 || count == INT_MAX) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Look up and lock the calculator, checking the stack holds the
+	// coefficients and argument.
+	retval = lock_top(handle, count + 1, TYPE_BIT(TYPE_DOUBLE), &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Leave the value in place of the polynomial.
+	values = calc->values + calc->size - count - 1;
+	values[0] = polynomial(values, count, values[count]);
+	calc->size -= count;
+	log_rewrite(calc, calc->size - 1, calc->size + count);
+
+	// If valuep is valid, return the value.
+	if(valuep) {
+		*valuep = values[0];
+	}
+
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_matmul - Replace two matrices at the top of the stack with
+ *	their product.
+ *	@handle - handle of calculator
+ *	@rows - rows of the first matrix
+ *	@inner - columns of the first matrix and rows of the second
+ *	@cols - columns of the second matrix
+ *
+ *	Matrices are stored row-major with their first row deepest. The second
+ *	matrix is on top, and the product is left as a @rows by @cols matrix.
+ */
+int rpncalc_matmul(int handle, int rows, int inner, int cols) {
+	struct rpncalc* calc;
+	struct rpncalc_run state = { .budget = LONG_MAX, .resched = RPNCALC_RESCHED_STEPS };
+	double* values;
+	int asize;
+	int bsize;
+	int csize;
+	int retval;
+
+	// Make sure the dimensions are valid.
+	if(matrix_size(rows, inner, &asize) != RPNCALC_E_SUCCESS ||
+			matrix_size(inner, cols, &bsize) != RPNCALC_E_SUCCESS ||
+			matrix_size(rows, cols, &csize) != RPNCALC_E_SUCCESS ||
+			asize > INT_MAX - bsize) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Look up and lock the calculator, checking the stack holds both
+	// matrices.
+	retval = lock_top(handle, asize + bsize, TYPE_BIT(TYPE_DOUBLE), &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make room above the stack for the product.
+	retval = reserve(calc, csize);
+	if(retval != RPNCALC_E_SUCCESS) {
+		unlock_rpncalc(calc);
+		return retval;
+	}
+
+	// Multiply above the stack, then move the product over the matrices.
+	values = calc->values + calc->size - asize - bsize;
+	matrix_multiply(values, values + asize, calc->values + calc->size, rows, inner, cols, &state);
+	memmove(values, calc->values + calc->size, csize * sizeof(double));
+	calc->size -= asize + bsize - csize;
+	log_rewrite(calc, calc->size - csize, calc->size - csize + asize + bsize);
+
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_transpose - Transpose the matrix at the top of the stack.
+ *	@handle - handle of calculator
+ *	@rows - rows of the matrix
+ *	@cols - columns of the matrix
+ *
+ *	The matrix is stored row-major with its first row deepest, and is left
+ *	as a @cols by @rows matrix.
+ */
+int rpncalc_transpose(int handle, int rows, int cols) {
+	struct rpncalc* calc;
+	double* values;
+	int size;
+	int retval;
+
+	// Make sure the dimensions are valid.
+	if(matrix_size(rows, cols, &size) != RPNCALC_E_SUCCESS) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Look up and lock the calculator, checking the stack holds the matrix.
+	retval = lock_top(handle, size, TYPE_BIT(TYPE_DOUBLE), &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make room above the stack for the transpose.
+	retval = reserve(calc, size);
+	if(retval != RPNCALC_E_SUCCESS) {
+		unlock_rpncalc(calc);
+		return retval;
+	}
+
+	// Transpose above the stack, then copy it back over the matrix.
+	values = calc->values + calc->size - size;
+	matrix_transpose(values, calc->values + calc->size, rows, cols);
+	memcpy(values, calc->values + calc->size, size * sizeof(double));
+	log_rewrite(calc, calc->size - size, calc->size);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_det - Replace the square matrix at the top of the stack with
+ *	its determinant.
+ *	@handle - handle of calculator
+ *	@n - rows and columns of the matrix
+ *	@valuep - pointer to return value with, or NULL
+ */
+int rpncalc_det(int handle, int n, double* valuep) {
+	struct rpncalc* calc;
+	struct rpncalc_run state = { .budget = LONG_MAX, .resched = RPNCALC_RESCHED_STEPS };
+	double* values;
+	double det;
+	int size;
+	int retval;
+
+	// Make sure the dimensions are valid.
+	if(matrix_size(n, n, &size) != RPNCALC_E_SUCCESS) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Look up and lock the calculator, checking the stack holds the matrix.
+	retval = lock_top(handle, size, TYPE_BIT(TYPE_DOUBLE), &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Reduce the matrix to upper triangular form in place. A singular
+	// matrix just has a zero determinant.
+	values = calc->values + calc->size - size;
+	eliminate(values, 0, n, 0, &det, &state);
+
+	// Leave the determinant in place of the matrix.
+	values[0] = det;
+	calc->size -= size - 1;
+	log_rewrite(calc, calc->size - 1, calc->size + size - 1);
+
+	// If valuep is valid, return the determinant.
+	if(valuep) {
+		*valuep = det;
+	}
+
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_solve - Replace a linear system at the top of the stack with
+ *	its solution.
+ *	@handle - handle of calculator
+ *	@n - rows and columns of the coefficient matrix
+ *	@cols - number of right hand sides
+ *
+ *	Solves A X = B, where the @n by @n matrix A is below the @n by @cols
+ *	matrix B on top of the stack, using LU decomposition with partial
+ *	pivoting. Both are replaced by the @n by @cols matrix X. If A is
+ *	singular, the stack is left unchanged and RPNCALC_E_INVALID returned.
+ */
+int rpncalc_solve(int handle, int n, int cols) {
+	struct rpncalc* calc;
+	struct rpncalc_run state = { .budget = LONG_MAX, .resched = RPNCALC_RESCHED_STEPS };
+	double* values;
+	double* scratch;
+	double det;
+	int asize;
+	int bsize;
+	int retval;
+
+	// Make sure the dimensions are valid.
+	if(matrix_size(n, n, &asize) != RPNCALC_E_SUCCESS ||
+			matrix_size(n, cols, &bsize) != RPNCALC_E_SUCCESS ||
+			asize > INT_MAX - bsize) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Look up and lock the calculator, checking the stack holds the system.
+	retval = lock_top(handle, asize + bsize, TYPE_BIT(TYPE_DOUBLE), &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make room above the stack to work on a copy of the system, so the
+	// stack is untouched if it turns out to be singular.
+	retval = reserve(calc, asize + bsize);
+	if(retval != RPNCALC_E_SUCCESS) {
+		unlock_rpncalc(calc);
+		return retval;
+	}
+	values = calc->values + calc->size - asize - bsize;
+	scratch = calc->values + calc->size;
+	memcpy(scratch, values, (asize + bsize) * sizeof(double));
+
+	// Factor the copy, applying the same row operations to B.
+	retval = eliminate(scratch, scratch + asize, n, cols, &det, &state);
+	if(retval != RPNCALC_E_SUCCESS) {
+		unlock_rpncalc(calc);
+		return retval;
+	}
+
+	// Solve and move the solution over the system.
+	back_substitute(scratch, scratch + asize, n, cols, &state);
+	memmove(values, scratch + asize, bsize * sizeof(double));
+	calc->size -= asize;
+	log_rewrite(calc, calc->size - bsize, calc->size + asize);
+
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_push_complex - Push a complex number onto the calculator stack.
+ *	@handle - handle of complex calculator
+ *	@re - real part
+ *	@im - imaginary part
+ */
+int rpncalc_push_complex(int handle, double re, double im) {
+	struct rpncalc* calc;
+	int retval;
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure the stack holds complex numbers.
+	if(calc->ops->type != TYPE_COMPLEX) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Push the value onto the stack.
+	retval = reserve(calc, 1);
+	if(retval == RPNCALC_E_SUCCESS) {
+		calc->complexes[calc->size].re = re;
+		calc->complexes[calc->size].im = im;
+		calc->size++;
+		log_rewrite(calc, calc->size - 1, calc->size - 1);
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_pop_complex - Pop a complex number off the calculator stack.
+ *	@handle - handle of complex calculator
+ *	@rep - optional pointer to return real part with
+ *	@imp - optional pointer to return imaginary part with
+ */
+int rpncalc_pop_complex(int handle, double* rep, double* imp) {
+	struct rpncalc* calc;
+	struct rpncalc_complex* value;
+	int retval;
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure the stack holds complex numbers.
+	if(calc->ops->type != TYPE_COMPLEX) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Fail if the stack is empty.
+	if(calc->size == 0) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	// Take the value off the top of the stack.
+	value = &calc->complexes[--calc->size];
+	log_rewrite(calc, calc->size, calc->size + 1);
+	if(rep) {
+		*rep = value->re;
+	}
+	if(imp) {
+		*imp = value->im;
+	}
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_at_complex - Get a complex number from the stack.
+ *	@handle - handle of complex calculator
+ *	@index - index of value from the top of the stack
+ *	@rep - pointer to return real part with
+ *	@imp - pointer to return imaginary part with
+ */
+int rpncalc_at_complex(int handle, int index, double* rep, double* imp) {
+	struct rpncalc* calc;
+	struct rpncalc_complex* value;
+	int retval;
+
+	// Make sure rep and imp are valid.
+	if(!rep || !imp) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure the stack holds complex numbers and index is valid.
+	if(calc->ops->type != TYPE_COMPLEX || index < 0 || index >= calc->size) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Index 0 is the top of the stack.
+	value = &calc->complexes[calc->size - 1 - index];
+	*rep = value->re;
+	*imp = value->im;
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_cop - Perform complex operation on calculator stack.
+ *	@handle - handle of complex calculator
+ *	@op - one of '+', '-', '*', '/', 'c', 'a' or 'p'
+ *	@rep - optional pointer to return real part of the top with
+ *	@imp - optional pointer to return imaginary part of the top with
+ *
+ *	'+', '-', '*' and '/' replace the top two values with their result.
+ *	'c' conjugates the top value, and 'a' and 'p' replace it with its
+ *	magnitude and its phase in (-pi, pi] as real numbers.
+ */
+int rpncalc_cop(int handle, char op, double* rep, double* imp) {
+	struct rpncalc* calc;
+	struct rpncalc_complex* value;
+	int opcode = 0;
+	int retval;
+
+	// Make sure op is valid, and find the operator function of the binary
+	// ones.
+	switch(op) {
+		case '+':
+			opcode = OP_ADD;
+			break;
+		case '-':
+			opcode = OP_SUBTRACT;
+			break;
+		case '*':
+			opcode = OP_MULTIPLY;
+			break;
+		case '/':
+			opcode = OP_DIVIDE;
+			break;
+		case 'c':
+		case 'a':
+		case 'p':
+			break;
+		default:
+			return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure the stack holds complex numbers.
+	if(calc->ops->type != TYPE_COMPLEX) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Combine the top two values through the stack's operator function, or
+	// transform the top value in place.
+	if(opcode) {
+		retval = do_binary(calc, opcode);
+		if(retval != RPNCALC_E_SUCCESS) {
+			unlock_rpncalc(calc);
+			return retval;
+		}
+		log_rewrite(calc, calc->size - 1, calc->size + 1);
+	} else {
+		if(calc->size < 1) {
+			unlock_rpncalc(calc);
+			return RPNCALC_E_INSUFFICIENT;
+		}
+		calc->complexes[calc->size - 1] = complex_unary(op, calc->complexes[calc->size - 1]);
+		log_rewrite(calc, calc->size - 1, calc->size);
+	}
+
+	// If rep and imp are valid, return the top of the stack.
+	value = calc->complexes + calc->size - 1;
+	if(rep) {
+		*rep = value->re;
+	}
+	if(imp) {
+		*imp = value->im;
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_push_int - Push an integer onto the calculator stack.
+ *	@handle - handle of integer or decimal calculator
+ *	@value - value to push, in units of 10^-RPNCALC_DECIMAL_DIGITS for
+ *	decimal calculators
+ */
+int rpncalc_push_int(int handle, s128 value) {
+	struct rpncalc* calc;
+	int retval;
+
+	// Look up and lock the calculator, checking it holds integers.
+	retval = lock_integers(handle, &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Push the value onto the stack.
+	retval = reserve(calc, 1);
+	if(retval == RPNCALC_E_SUCCESS) {
+		calc->integers[calc->size++] = value;
+		log_rewrite(calc, calc->size - 1, calc->size - 1);
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_pop_int - Pop an integer off the calculator stack.
+ *	@handle - handle of integer or decimal calculator
+ *	@valuep - optional pointer to return value with
+ */
+int rpncalc_pop_int(int handle, s128* valuep) {
+	struct rpncalc* calc;
+	int retval;
+
+	// Look up and lock the calculator, checking it holds integers.
+	retval = lock_integers(handle, &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Fail if the stack is empty.
+	if(calc->size == 0) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	// Take the value off the top of the stack.
+	calc->size--;
+	if(valuep) {
+		*valuep = calc->integers[calc->size];
+	}
+	log_rewrite(calc, calc->size, calc->size + 1);
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_at_int - Get an integer from the stack.
+ *	@handle - handle of integer or decimal calculator
+ *	@index - index of value from the top of the stack
+ *	@valuep - pointer to return value with
+ */
+int rpncalc_at_int(int handle, int index, s128* valuep) {
+	struct rpncalc* calc;
+	int retval;
+
+	// Make sure valuep is valid.
+	if(!valuep) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Look up and lock the calculator, checking it holds integers.
+	retval = lock_integers(handle, &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure index is valid.
+	if(index < 0 || index >= calc->size) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Index 0 is the top of the stack.
+	*valuep = calc->integers[calc->size - 1 - index];
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_iop - Perform integer operation on calculator stack.
+ *	@handle - handle of integer or decimal calculator
+ *	@op - one of '+', '-', '*', '/' or '%'
+ *	@valuep - optional pointer to return value with
+ *
+ *	Replaces the top two values with their result. '/' rounds to the
+ *	nearest value, ties to even, and '%' is the remainder of truncating
+ *	division, with the sign of the dividend. A result out of range fails
+ *	with RPNCALC_E_OVERFLOW and division by zero with RPNCALC_E_INVALID,
+ *	leaving the stack unchanged.
+ */
+int rpncalc_iop(int handle, char op, s128* valuep) {
+	struct rpncalc* calc;
+	int opcode;
+	int retval;
+
+	// Make sure op is valid, and find its operator function.
+	switch(op) {
+		case '+':
+			opcode = OP_ADD;
+			break;
+		case '-':
+			opcode = OP_SUBTRACT;
+			break;
+		case '*':
+			opcode = OP_MULTIPLY;
+			break;
+		case '/':
+			opcode = OP_DIVIDE;
+			break;
+		case '%':
+			opcode = OP_REMAINDER;
+			break;
+		default:
+			return RPNCALC_E_INVALID;
+	}
+
+	// Look up and lock the calculator, checking it holds integers.
+	retval = lock_integers(handle, &calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Combine the top two values into the second, which becomes the top,
+	// through the operator function of the stack's type.
+	retval = do_binary(calc, opcode);
+	if(retval == RPNCALC_E_SUCCESS) {
+		log_rewrite(calc, calc->size - 1, calc->size + 1);
+		if(valuep) {
+			*valuep = calc->integers[calc->size - 1];
+		}
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_push_text - Push numbers written out as text.
+ *	@handle - handle of double or float calculator
+ *	@text - decimal numbers separated by spaces or newlines
+ *	@len - length of text
+ *	@usedp - pointer to return the number of bytes consumed with
+ *
+ *	Numbers are only pushed once the separator after them is seen, so text
+ *	can be passed in pieces: *usedp is where the last, unfinished number
+ *	starts, and the caller passes it again with the next piece. Any byte up
+ *	to ' ' separates numbers. On RPNCALC_E_INVALID the numbers before the
+ *	bad one have been pushed and *usedp is where the bad one starts.
+ *	Windows and sketches do not keep a stack and fail with
+ *	RPNCALC_E_INVALID.
+ */
+int rpncalc_push_text(int handle, const char* text, int len, int* usedp) {
+	struct rpncalc* calc;
+	const char* end = text + len;
+	const char* token;
+	const char* p = text;
+	double value;
+	int old;
+	int retval;
+
+	// Make sure text and usedp are valid.
+	if(!text || len < 0 || !usedp) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure the stack holds doubles or floats.
+	if(!calc->ops->set) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Push each number that is followed by a separator.
+	old = calc->size;
+	for(;;) {
+		token = skip_separators(p, end);
+		p = find_separator(token, end);
+		if(p == end) {
+			p = token;
+			break;
+		}
+		retval = parse_number(token, p - token, &value);
+		if(retval != RPNCALC_E_SUCCESS) {
+			p = token;
+			break;
+		}
+
+		// Numbers take at least two bytes each, so when the stack is full
+		// make room for all the rest at once.
+		if(calc->size == calc->capacity) {
+			retval = reserve(calc, (end - p) / 2 + 1);
+			if(retval != RPNCALC_E_SUCCESS) {
+				p = token;
+				break;
+			}
+		}
+		calc->ops->set(calc->data, calc->size++, value);
+	}
+	*usedp = p - text;
+	log_rewrite(calc, old, old);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_format - Write a double as text.
+ *	@value - value to write
+ *	@text - buffer of at least RPNCALC_FORMAT_MAX bytes to write to
+ *
+ *	Writes the shortest decimal that reads back as exactly @value, with a
+ *	terminating NUL, and returns its length. Magnitudes from 1e-6 up to
+ *	1e21 are written in positional notation, others as digits and an
+ *	exponent. Infinities and NaN are written as inf, -inf and nan, which
+ *	rpncalc_push_text reads back too.
+ */
+int rpncalc_format(double value, char* text) {
+	char digits[20];
+	char* p = text;
+	u64 bits;
+	u64 decimal;
+	int ndigits = 0;
+	int exponent;
+	int point;
+	int i;
+
+	memcpy(&bits, &value, sizeof(bits));
+	if(bits >> 63) {
+		*p++ = '-';
+	}
+	bits &= ~(1ULL << 63);
+
+	// Write the special values.
+	if(bits >= 0x7FFULL << 52) {
+		if(bits > 0x7FFULL << 52) {
+			p = text;
+		}
+		strcpy(p, bits > 0x7FFULL << 52 ? "nan" : "inf");
+		return p - text + 3;
+	}
+	if(!bits) {
+		strcpy(p, "0");
+		return p - text + 1;
+	}
+
+	// Find the shortest digits, and where the decimal point goes in them.
+	decimal = shortest(bits, &exponent);
+	for(; decimal; decimal /= 10) {
+		digits[ndigits++] = '0' + decimal % 10;
+	}
+	point = ndigits + exponent;
+
+	// Write positional notation, padding with zeros on either side.
+	if(point > -6 && point <= 21) {
+		if(point <= 0) {
+			*p++ = '0';
+			*p++ = '.';
+			for(i = point; i < 0; i++) {
+				*p++ = '0';
+			}
+		}
+		for(i = ndigits - 1; i >= 0; i--) {
+			*p++ = digits[i];
+			if(ndigits - i == point && i) {
+				*p++ = '.';
+			}
+		}
+		for(i = ndigits; i < point; i++) {
+			*p++ = '0';
+		}
+		*p = 0;
+		return p - text;
+	}
+
+	// Write the digits with the point after the first, then the exponent.
+	*p++ = digits[ndigits - 1];
+	if(ndigits > 1) {
+		*p++ = '.';
+		for(i = ndigits - 2; i >= 0; i--) {
+			*p++ = digits[i];
+		}
+	}
+	exponent = point - 1;
+	*p++ = 'e';
+	*p++ = exponent < 0 ? '-' : '+';
+	exponent = abs(exponent);
+	if(exponent >= 100) {
+		*p++ = '0' + exponent / 100;
+	}
+	if(exponent >= 10) {
+		*p++ = '0' + exponent / 10 % 10;
+	}
+	*p++ = '0' + exponent % 10;
+	*p = 0;
+
+	return p - text;
+}
+
+/**
+ *	rpncalc_print - Write stack values as text, one per line.
+ *	@handle - handle of double or float calculator
+ *	@indexp - pointer to the position of the first value to write, counting
+ *	from the bottom of the stack, which is advanced past those written
+ *	@text - buffer to write to
+ *	@len - size of text
+ *	@usedp - pointer to return the number of bytes written with
+ *
+ *	Writes as many whole lines as fit, formatted by rpncalc_format, so the
+ *	stack can be read out in pieces. Writing nothing at the top of the
+ *	stack succeeds. Fails with RPNCALC_E_INVALID if there are values left
+ *	but @len is too small for the next one.
+ */
+int rpncalc_print(int handle, int* indexp, char* text, int len, int* usedp) {
+	struct rpncalc* calc;
+	char line[RPNCALC_FORMAT_MAX];
+	int used = 0;
+	int n;
+	int retval;
+
+	// Make sure the pointers are valid.
+	if(!indexp || !text || len < 0 || !usedp || *indexp < 0) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure the stack holds doubles or floats.
+	if(!calc->ops->get) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Write lines while they fit.
+	for(; *indexp < calc->size; (*indexp)++) {
+		n = rpncalc_format(calc->ops->get(calc->data, *indexp), line);
+		if(used + n + 1 > len) {
+			break;
+		}
+		memcpy(text + used, line, n);
+		text[used + n] = '\n';
+		used += n + 1;
+	}
+	*usedp = used;
+
+	// Fail if not even one line fit.
+	if(*indexp < calc->size && !used) {
+		retval = RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_push_packed - Push values in the packed encoding.
+ *	@handle - handle of calculator
+ *	@data - packed values, as written by rpncalc_save
+ *	@len - length of data in bytes
+ *	@usedp - pointer to return the number of bytes pushed with
+ *
+ *	Each value is encoded against the one below it, so the first against
+ *	the value on top of the stack, or zero if it is empty. A stack saved in
+ *	pieces can then be pushed back in the same pieces. A value cut off by
+ *	the end of @data is left for the next call. A bad value stops the push,
+ *	after the values before it, and fails with RPNCALC_E_INVALID.
+ */
+int rpncalc_push_packed(int handle, const void* data, int len, int* usedp) {
+	struct rpncalc* calc;
+	const u8* in = data;
+	int used = 0;
+	int old;
+	int n;
+	int retval;
+
+	// Make sure data and usedp are valid.
+	if(!data || len < 0 || !usedp) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Decode straight onto the stack.
+	old = calc->size;
+	while(used < len) {
+
+		// Values take at most RPNCALC_PACKED_MAX bytes each, so when the
+		// stack is full make room for at least that many of the rest. The
+		// stack still grows geometrically past that, without reserving a
+		// slot for every byte when the values are short.
+		if(calc->size == calc->capacity) {
+			retval = reserve(calc, DIV_ROUND_UP(len - used, RPNCALC_PACKED_MAX));
+			if(retval != RPNCALC_E_SUCCESS) {
+				break;
+			}
+		}
+		n = decode_value(calc->data, calc->size, calc->ops, in + used, len - used);
+		if(n <= 0) {
+			retval = n < 0 ? n : RPNCALC_E_SUCCESS;
+			break;
+		}
+		calc->size++;
+		used += n;
+	}
+	*usedp = used;
+	log_rewrite(calc, old, old);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_save - Write stack values in the packed encoding.
+ *	@handle - handle of calculator
+ *	@indexp - pointer to the position of the first value to write, counting
+ *	from the bottom of the stack, which is advanced past those written
+ *	@data - buffer to write to
+ *	@len - size of data
+ *	@usedp - pointer to return the number of bytes written with
+ *
+ *	Integers are written as the difference from the value below, zigzagged
+ *	so small steps either way are small, seven bits to a byte. Floating
+ *	point values are written as their bits XORed with those of the value
+ *	below, in a byte giving the counts of leading and trailing zero bytes
+ *	followed by the bytes between. No value takes more than
+ *	RPNCALC_PACKED_MAX bytes. Writes as many values as fit. Writing nothing
+ *	at the top of the stack succeeds. Fails with RPNCALC_E_INVALID if there
+ *	are values left but @len is too small for the next one.
+ */
+int rpncalc_save(int handle, int* indexp, void* data, int len, int* usedp) {
+	struct rpncalc* calc;
+	u8 value[RPNCALC_PACKED_MAX];
+	u8* out = data;
+	int used = 0;
+	int n;
+	int retval;
+
+	// Make sure the pointers are valid.
+	if(!indexp || !data || len < 0 || !usedp || *indexp < 0) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Encode straight into the buffer while any value fits, then a value
+	// at a time near the end.
+	for(; *indexp < calc->size; (*indexp)++) {
+		if(len - used >= RPNCALC_PACKED_MAX) {
+			used += encode_value(out + used, calc->ops, calc->data, *indexp);
+			continue;
+		}
+		n = encode_value(value, calc->ops, calc->data, *indexp);
+		if(n > len - used) {
+			break;
+		}
+		memcpy(out + used, value, n);
+		used += n;
+	}
+	*usedp = used;
+
+	// Fail if not even one value fit.
+	if(*indexp < calc->size && !used) {
+		retval = RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_pop_packed - Pop values in the packed encoding.
+ *	@handle - handle of calculator
+ *	@count - number of values to pop
+ *	@data - buffer to write to
+ *	@len - size of data
+ *	@usedp - pointer to return the number of bytes written with
+ *
+ *	Writes the top @count values bottom first, as rpncalc_save would, and
+ *	takes them off the stack. The first is encoded against the value left
+ *	on top, so pushing them back restores the stack. Fails with
+ *	RPNCALC_E_LIMIT, popping nothing, if they do not all fit in @len.
+ */
+int rpncalc_pop_packed(int handle, int count, void* data, int len, int* usedp) {
+	struct rpncalc* calc;
+	u8 value[RPNCALC_PACKED_MAX];
+	u8* out = data;
+	int used = 0;
+	int index;
+	int n;
+	int retval;
+
+	// Make sure the arguments are valid.
+	if(count < 0 || !data || len < 0 || !usedp) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure there are enough values.
+	if(count > calc->size) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	// Encode the values, giving up if they do not fit.
+	for(index = calc->size - count; index < calc->size; index++) {
+		if(len - used >= RPNCALC_PACKED_MAX) {
+			used += encode_value(out + used, calc->ops, calc->data, index);
+			continue;
+		}
+		n = encode_value(value, calc->ops, calc->data, index);
+		if(n > len - used) {
+			unlock_rpncalc(calc);
+			return RPNCALC_E_LIMIT;
+		}
+		memcpy(out + used, value, n);
+		used += n;
+	}
+	*usedp = used;
+
+	// Take them off the stack.
+	calc->size -= count;
+	log_rewrite(calc, calc->size, calc->size + count);
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_drop - Pop values off the stack, discarding them.
+ *	@handle - handle of calculator
+ *	@count - number of values to pop
+ */
+int rpncalc_drop(int handle, int count) {
+	struct rpncalc* calc;
+	int retval;
+
+	// Make sure count is valid.
+	if(count < 0) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure there are enough values.
+	if(count > calc->size) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	// Take them off the stack.
+	calc->size -= count;
+	log_rewrite(calc, calc->size, calc->size + count);
+	shrink(calc);
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_push_raw - Push values in the stack's own binary layout.
+ *	@handle - handle of calculator
+ *	@data - values, each as the stack holds it, so doubles for double
+ *	calculators and 128-bit integers for integer and decimal ones
+ *	@len - length of data in bytes
+ *	@usedp - pointer to return the number of bytes pushed with
+ *
+ *	Copies the whole values in @data onto the stack in one go. Bytes of a
+ *	value cut off by the end of @data are left for the next call.
+ */
+int rpncalc_push_raw(int handle, const void* data, int len, int* usedp) {
+	struct rpncalc* calc;
+	int count;
+	int retval;
+
+	// Make sure data and usedp are valid.
+	if(!data || len < 0 || !usedp) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Copy the values straight onto the top of the stack.
+	count = len / calc->ops->width;
+	*usedp = 0;
+	if(count) {
+		retval = reserve(calc, count);
+	}
+	if(count && retval == RPNCALC_E_SUCCESS) {
+		memcpy(calc->data + (size_t)calc->size * calc->ops->width, data, (size_t)count * calc->ops->width);
+		calc->size += count;
+		*usedp = count * calc->ops->width;
+		log_rewrite(calc, calc->size - count, calc->size - count);
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_subscribe - Receive the results of a calculator.
+ *	@handle - handle of calculator
+ *	@sub - subscriber, with publish set and calc NULL, which must stay
+ *	valid until it is unsubscribed
+ *
+ *	The value left on top by each successful rpncalc_op and rpncalc_eval
+ *	is passed to @sub->publish with the calculator locked, so publish must
+ *	not sleep or call back into the calculator. Results from one calculator
+ *	arrive in order. Deleting the calculator ends the subscription, but
+ *	@sub still has to be unsubscribed.
+ */
+int rpncalc_subscribe(int handle, struct rpncalc_subscriber* sub) {
+	struct rpncalc* calc;
+
+	// Make sure sub is valid and not subscribed already.
+	if(!sub || !sub->publish || sub->calc) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Add the subscriber, which keeps the reference from the lookup so the
+	// calculator outlives the subscription.
+	mutex_lock(&calc->lock);
+	list_add_tail(&sub->next, &calc->subscribers);
+	sub->calc = calc;
+	mutex_unlock(&calc->lock);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_unsubscribe - Stop receiving the results of a calculator.
+ *	@sub - subscriber passed to rpncalc_subscribe
+ *
+ *	Once this returns, @sub->publish is not called again and @sub can be
+ *	freed or subscribed again. Fails with RPNCALC_E_INVALID if @sub is not
+ *	subscribed.
+ */
+int rpncalc_unsubscribe(struct rpncalc_subscriber* sub) {
+	struct rpncalc* calc;
+
+	// Make sure sub is subscribed.
+	if(!sub || !sub->calc) {
+		return RPNCALC_E_INVALID;
+	}
+	calc = sub->calc;
+
+	// Remove the subscriber, unless deleting the calculator already has, and
+	// drop its reference.
+	mutex_lock(&calc->lock);
+	list_del_init(&sub->next);
+	sub->calc = 0;
+	unlock_rpncalc(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+/**
+ *	rpncalc_version - Get the version of a calculator stack.
+ *	@handle - handle of calculator
+ *	@versionp - pointer to return version with
+ *
+ *	The version goes up by one with each change rpncalc_changes describes,
+ *	so a reader can tell whether the stack changed. For double and float
+ *	calculators, this also starts keeping the changes, so a mirror taken
+ *	after reading the version can be brought up to date with them. The
+ *	mirror is consistent if the version is the same before and after it
+ *	reads the stack.
+ */
+int rpncalc_version(int handle, u64* versionp) {
+	struct rpncalc* calc;
+	int retval = RPNCALC_E_SUCCESS;
+
+	// Make sure versionp is valid.
+	if(!versionp) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Read the version, keeping changes from here on if possible.
+	mutex_lock(&calc->lock);
+	if(calc->ops->get) {
+		retval = start_log(calc);
+	}
+	*versionp = calc->version;
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_changes - Read the changes made to a stack after a version.
+ *	@handle - handle of double or float calculator
+ *	@since - version to read the changes after
+ *	@changes - array to return changes in, oldest first
+ *	@max - length of changes
+ *	@countp - pointer to return the number of changes with
+ *
+ *	Applying the changes in order to a copy of the stack at version @since
+ *	brings it to the version of the last one. Every operation is described
+ *	as popping the values it changed and pushing their new values, except
+ *	that a value changed in place is replaced. Only the last
+ *	RPNCALC_CHANGES changes are kept, from when rpncalc_version or this was
+ *	first called. Fails with RPNCALC_E_LIMIT if some changes after @since
+ *	are not kept, so the caller has to read the whole stack again.
+ */
+int rpncalc_changes(int handle, u64 since, struct rpncalc_change* changes, int max, int* countp) {
+	struct rpncalc* calc;
+	int count;
+	int i;
+	int retval;
+
+	// Make sure the pointers are valid.
+	if(!changes || max < 0 || !countp) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator.
+	mutex_lock(&calc->lock);
+
+	// Make sure the stack holds doubles or floats, and since has happened.
+	if(!calc->ops->get || since > calc->version) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Fail if changes after since were made before the log started or
+	// have been overwritten.
+	retval = start_log(calc);
+	if(retval == RPNCALC_E_SUCCESS && (since < calc->logged || calc->version - since > RPNCALC_CHANGES)) {
+		retval = RPNCALC_E_LIMIT;
+	}
+
+	// Copy the changes out.
+	if(retval == RPNCALC_E_SUCCESS) {
+		count = min_t(u64, calc->version - since, max);
+		for(i = 0; i < count; i++) {
+			changes[i] = calc->changes[(since + 1 + i) % RPNCALC_CHANGES];
+		}
+		*countp = count;
+	}
+
+	// Unlock the calculator.
+	unlock_rpncalc(calc);
+
+	return retval;
+}
+
+/**
+ *	rpncalc_start - Start background work. Called when the module loads.
+ */
+void rpncalc_start(void) {
+	select_kernels();
+	schedule_delayed_work(&compress_work, HZ);
+}
+
+/**
+ *	rpncalc_stop - Stop background work. Called when the module unloads.
+ */
+void rpncalc_stop(void) {
+	cancel_delayed_work_sync(&compress_work);
+}
+
+static struct rpncalc* get_rpncalc(int handle) {
+	struct rpncalc* calc = 0;
+	struct rpncalc* cur;
+
+	// Iterator over all rpncalcs in bucket mapped to by handle looking
+	// for rpncalc with handle we are looking for.
+	hash_for_each_possible(calcs, cur, next, handle){
+		if(cur->handle == handle) {
+			calc = cur;
+			break;
+		}
+	}
+
+	// Hold the calculator until the caller puts it, so deleting it in the
+	// meantime does not free it.
+	if(calc) {
+		kref_get(&calc->ref);
+	}
+
+	return calc;
+}
+
+static struct rpncalc* create_rpncalc(int node) {
+	struct rpncalc* calc;
+
+	// Allocate memory for calculator.
+	calc = kmalloc_node(sizeof(struct rpncalc), GFP_KERNEL, node);
+	if(!calc) {
+		return 0;
+	}
+
+	// Initialize the calculator.
+	calc->data = 0;
+	calc->size = 0;
+	calc->capacity = 0;
+	calc->ops = &double_ops;
+	calc->huge = 0;
+	calc->node = node;
+	calc->remote_node = node;
+	calc->remote_hits = 0;
+	calc->packed = 0;
+	calc->version = 0;
+	calc->changes = 0;
+	calc->touched = jiffies;
+	calc->nregisters = 0;
+	calc->budget = RPNCALC_DEFAULT_BUDGET;
+	INIT_LIST_HEAD(&calc->words);
+	INIT_LIST_HEAD(&calc->subscribers);
+	calc->kind = KIND_STACK;
+	mutex_init(&calc->lock);
+	kref_init(&calc->ref);
+
+	return calc;
+}
+
+static void insert_rpncalc(struct rpncalc* calc, int* handlep) {
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Assign a handle and insert calculator into table.
+	calc->handle = next_handle++;
+	hash_add(calcs, &calc->next, calc->handle);
+
+	// Assign calculator handle to return pointer.
+	*handlep = calc->handle;
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+}
+
+static void free_rpncalc(struct kref* ref) {
+	struct rpncalc* calc = container_of(ref, struct rpncalc, ref);
+	struct rpncalc_word* word;
+
+	// Free the stack, whether or not it is compressed, and its change log.
+	free_stack(calc);
+	kvfree(calc->packed);
+	kfree(calc->changes);
+
+	// Free the words defined on this calculator.
+	while(!list_empty(&calc->words)) {
+		word = list_first_entry(&calc->words, struct rpncalc_word, next);
+		list_del(&word->next);
+		put_program(word->program);
+		kfree(word);
+	}
+
+	// Free the window, statistics or sketch.
+	switch(calc->kind) {
+		case KIND_WINDOW:
+		{
+			free_window(calc->window);
+			break;
+		}
+		case KIND_ACCUM:
+		{
+			kfree(calc->accum);
+			break;
+		}
+		case KIND_QUANTILE:
+		{
+			kvfree(calc->quantile);
+			break;
+		}
+		case KIND_DISTINCT:
+		{
+			kfree(calc->hll);
+			break;
+		}
+	}
+
+	// Free the rpncalc.
+	kfree(calc);
+}
+
+static void put_rpncalc(struct rpncalc* calc) {
+	kref_put(&calc->ref, free_rpncalc);
+}
+
+static void unlock_rpncalc(struct rpncalc* calc) {
+
+	// Unlock the calculator and drop the reference from looking it up.
+	mutex_unlock(&calc->lock);
+	put_rpncalc(calc);
+}
+
+static void lock_pair(struct rpncalc* calc1, struct rpncalc* calc2) {
+
+	// Always lock the calculator with the lower handle first.
+	if(calc1->handle < calc2->handle) {
+		mutex_lock(&calc1->lock);
+		mutex_lock_nested(&calc2->lock, SINGLE_DEPTH_NESTING);
+	} else {
+		mutex_lock(&calc2->lock);
+		mutex_lock_nested(&calc1->lock, SINGLE_DEPTH_NESTING);
+	}
+}
+
+static void* alloc_stack(struct rpncalc* calc, int* capacityp, int* hugep) {
+	size_t bytes;
+	void* data;
+
+	*hugep = 0;
+
+	// Fail if the size does not fit.
+	if(check_mul_overflow((size_t)*capacityp, (size_t)calc->ops->width, &bytes)) {
+		return 0;
+	}
+
+	// Small stacks come from the slab or base pages as usual. Stacks grow
+	// as users ask, so they are charged to the memory cgroup of whoever
+	// grows them.
+	if(!huge_kb || bytes < (size_t)huge_kb * 1024) {
+		return kvmalloc_node(bytes, GFP_KERNEL_ACCOUNT, calc->node);
+	}
+
+	// Reductions sweep deep stacks end to end, which misses in the TLB on
+	// every base page. Map them with huge pages instead, rounding up so the
+	// last one is not wasted. vmalloc_huge_node() falls back to base pages by
+	// itself if none are free.
+	bytes = min_t(size_t, round_up(bytes, PMD_SIZE), (size_t)INT_MAX * calc->ops->width);
+	data = vmalloc_huge_node(bytes, GFP_KERNEL_ACCOUNT, calc->node);
+	if(data) {
+		*capacityp = bytes / calc->ops->width;
+		*hugep = is_vm_area_hugepages(data);
+	}
+
+	return data;
+}
+
+static void set_stack(struct rpncalc* calc, void* data, int capacity, int huge) {
+
+	// Free the old stack and take the new one.
+	free_stack(calc);
+	calc->data = data;
+	calc->capacity = capacity;
+	calc->huge = huge;
+	if(huge) {
+		atomic_inc(&huge_stacks);
+	}
+}
+
+static void free_stack(struct rpncalc* calc) {
+	if(calc->huge) {
+		atomic_dec(&huge_stacks);
+	}
+	kvfree(calc->data);
+	calc->data = 0;
+	calc->capacity = 0;
+	calc->huge = 0;
+}
+
+static int reserve(struct rpncalc* calc, int count) {
+	void* data;
+	int capacity;
+	int huge;
+
+	// Nothing to do if there is already room.
+	if(count <= calc->capacity - calc->size) {
+		return RPNCALC_E_SUCCESS;
+	}
+
+	// Fail if the stack would outgrow an int.
+	if(count > INT_MAX / 2 - calc->size) {
+		return RPNCALC_E_NOMEM;
+	}
+
+	// Grow the stack geometrically so pushes are amortized O(1).
+	capacity = max(calc->capacity * 2, RPNCALC_MIN_CAPACITY);
+	capacity = max(capacity, calc->size + count);
+	data = alloc_stack(calc, &capacity, &huge);
+	if(!data) {
+		return RPNCALC_E_NOMEM;
+	}
+
+	// Move the values over.
+	if(calc->size) {
+		memcpy(data, calc->data, (size_t)calc->size * calc->ops->width);
+	}
+	set_stack(calc, data, capacity, huge);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static void shrink(struct rpncalc* calc) {
+	void* data;
+	int capacity = calc->capacity / 2;
+	int huge;
+
+	// Only give memory back once the stack is a quarter full, so pushes and
+	// pops around a boundary do not reallocate every time.
+	if(calc->size > calc->capacity / 4 || capacity < RPNCALC_MIN_CAPACITY) {
+		return;
+	}
+
+	// Keeping the larger stack is fine if memory is short.
+	data = alloc_stack(calc, &capacity, &huge);
+	if(!data) {
+		return;
+	}
+
+	// Huge pages are rounded up, which may leave nothing to give back.
+	if(capacity >= calc->capacity) {
+		kvfree(data);
+		return;
+	}
+
+	// Move the values over.
+	memcpy(data, calc->data, (size_t)calc->size * calc->ops->width);
+	set_stack(calc, data, capacity, huge);
+}
+
+static int push(struct rpncalc* calc, double value) {
+	int retval;
+
+	// Fail if the stack does not hold doubles or floats.
+	if(!(TYPE_BIT(calc->ops->type) & TYPES_REAL)) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Make room for the value.
+	retval = reserve(calc, 1);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Add the value to the top of the stack and increment size.
+	calc->ops->set(calc->data, calc->size++, value);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static int pop(struct rpncalc* calc, double* valuep) {
+
+	// Fail if the stack does not hold doubles or floats.
+	if(!(TYPE_BIT(calc->ops->type) & TYPES_REAL)) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Fail if the stack is empty.
+	if(calc->size == 0) {
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	// Take the value off the top of the stack and decrement size.
+	calc->size--;
+	if(valuep) {
+		*valuep = calc->ops->get(calc->data, calc->size);
+	}
+	shrink(calc);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static int do_binary(struct rpncalc* calc, int opcode) {
+	int retval;
+
+	// Not every type has every operator.
+	if(!calc->ops->binary[opcode]) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Check that there are at least two entries on the stack.
+	if(calc->size < 2) {
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	// Combine the top two values into the second, which becomes the top.
+	retval = calc->ops->binary[opcode](calc->data, calc->size);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+	calc->size--;
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static int do_select(struct rpncalc* calc) {
+
+	// Only real stacks have select.
+	if(!calc->ops->select) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Check that there are at least three entries on the stack.
+	if(calc->size < 3) {
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	// Replace the condition with the selected value.
+	calc->ops->select(calc->data, calc->size);
+	calc->size -= 2;
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static int valid_name(const char* name) {
+	int i;
+
+	// Names must be present and start with a letter or underscore.
+	if(!name || !(isalpha(name[0]) || name[0] == '_')) {
+		return 0;
+	}
+
+	// The rest of the name may also contain digits, up to the maximum length.
+	for(i = 1; name[i]; i++) {
+		if(i == RPNCALC_NAME_MAX - 1 || !(isalnum(name[i]) || name[i] == '_')) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int find_register(struct rpncalc* calc, const char* name) {
+	int i;
+
+	// Scan the registers in use for a matching name.
+	for(i = 0; i < calc->nregisters; i++) {
+		if(!strcmp(calc->registers[i].name, name)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static struct rpncalc_word* find_word(struct list_head* list, const char* name, int len) {
+	struct rpncalc_word* word;
+
+	// Scan the word list for a name matching the first len characters.
+	list_for_each_entry(word, list, next) {
+		if(!strncmp(word->name, name, len) && !word->name[len]) {
+			return word;
+		}
+	}
+
+	return 0;
+}
+
+static struct rpncalc_program* get_word(struct rpncalc* calc, const char* name, int len) {
+	struct rpncalc_word* word = 0;
+	struct rpncalc_program* program = 0;
+
+	// Words defined on the calculator take precedence.
+	if(calc) {
+		word = find_word(&calc->words, name, len);
+		if(word) {
+			kref_get(&word->program->ref);
+			return word->program;
+		}
+	}
+
+	// Fall back to global words.
+	mutex_lock(&words_lock);
+	word = find_word(&words, name, len);
+	if(word) {
+		program = word->program;
+		kref_get(&program->ref);
+	}
+	mutex_unlock(&words_lock);
+
+	return program;
+}
+
+static void free_program(struct kref* ref) {
+	struct rpncalc_program* program = container_of(ref, struct rpncalc_program, ref);
+	int i;
+
+	// Drop the references held by calls.
+	for(i = 0; i < program->length; i++) {
+		if(program->insns[i].opcode == OP_CALL) {
+			put_program(program->insns[i].program);
+		}
+	}
+
+	kfree(program);
+}
+
+static void put_program(struct rpncalc_program* program) {
+	kref_put(&program->ref, free_program);
+}
+
+static const char* next_token(const char* text, int* lenp) {
+	int len = 0;
+
+	// Skip leading whitespace.
+	while(isspace(*text)) {
+		text++;
+	}
+
+	// Return NULL at the end of the text.
+	if(!*text) {
+		return 0;
+	}
+
+	// The token runs until the next whitespace.
+	while(text[len] && !isspace(text[len])) {
+		len++;
+	}
+
+	*lenp = len;
+
+	return text;
+}
+
+static void emit(struct rpncalc_compiler* compiler, struct rpncalc_insn* insn, int pops, int pushes) {
+
+	// Track the deepest stack access, the running stack depth and its
+	// high water mark.
+	if(compiler->depth - pops < -compiler->needs) {
+		compiler->needs = pops - compiler->depth;
+	}
+	compiler->depth += pushes - pops;
+	compiler->peak = max(compiler->peak, compiler->depth);
+
+	// Append the instruction.
+	compiler->insns[compiler->length++] = *insn;
+}
+
+static int emit_word(struct rpncalc_compiler* compiler, struct rpncalc_program* program) {
+	struct rpncalc_insn insn;
+	int inline_word;
+	int i;
+
+	// Fail if calling the word would nest too deeply.
+	if(program->depth >= RPNCALC_CALL_DEPTH) {
+		put_program(program);
+		return RPNCALC_E_LIMIT;
+	}
+
+	// Only short words without jumps are inlined.
+	inline_word = program->length <= RPNCALC_INLINE_MAX;
+	for(i = 0; inline_word && i < program->length; i++) {
+		switch(program->insns[i].opcode) {
+			case OP_JZ:
+			case OP_JMP:
+			case OP_DO:
+			case OP_LOOP:
+				inline_word = 0;
+				break;
+		}
+	}
+
+	// Call words that are not inlined. The call takes over the reference
+	// to the program.
+	if(!inline_word) {
+		insn.opcode = OP_CALL;
+		insn.program = program;
+		compiler->peak = max(compiler->peak, compiler->depth + program->peak);
+		emit(compiler, &insn, program->needs, program->needs + program->effect);
+		compiler->calls = max(compiler->calls, program->depth);
+		return RPNCALC_E_SUCCESS;
+	}
+
+	// Inline short words. Calls copied out of the word need their own
+	// references.
+	for(i = 0; i < program->length; i++) {
+		insn = program->insns[i];
+		if(insn.opcode == OP_CALL) {
+			kref_get(&insn.program->ref);
+			compiler->calls = max(compiler->calls, insn.program->depth);
+		}
+		compiler->insns[compiler->length++] = insn;
+	}
+
+	// Account for the word's stack effect as a whole.
+	if(compiler->depth - program->needs < -compiler->needs) {
+		compiler->needs = program->needs - compiler->depth;
+	}
+	compiler->peak = max(compiler->peak, compiler->depth + program->peak);
+	compiler->depth += program->effect;
+
+	put_program(program);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static int compile(struct rpncalc* calc, const char* text, struct rpncalc_program** programp) {
+	struct rpncalc_compiler compiler = { .calc = calc };
+	struct rpncalc_program* program = 0;
+	struct rpncalc_program* callee;
+	struct rpncalc_frame* frame;
+	struct rpncalc_insn insn;
+	char name[RPNCALC_NAME_MAX];
+	const char* token;
+	const char* p;
+	int retval = RPNCALC_E_SUCCESS;
+	int nregisters = calc ? calc->nregisters : 0;
+	int ntokens = 0;
+	int opcode;
+	int len;
+	int i;
+
+	// Count the tokens to bound the number of instructions. Each token
+	// emits at most one instruction, or one inlined word.
+	for(p = text; (token = next_token(p, &len)); p = token + len) {
+		ntokens++;
+	}
+
+	// Allocate the instruction buffer.
+	compiler.insns = kmalloc_array(max(ntokens, 1) * RPNCALC_INLINE_MAX, sizeof(struct rpncalc_insn), GFP_KERNEL);
+	if(!compiler.insns) {
+		return RPNCALC_E_NOMEM;
+	}
+
+	for(p = text; retval == RPNCALC_E_SUCCESS && (token = next_token(p, &len)); p = token + len) {
+
+		// Look the token up in the builtins.
+		opcode = -1;
+		for(i = 0; i < ARRAY_SIZE(builtins); i++) {
+			if(!strncmp(builtins[i].name, token, len) && !builtins[i].name[len]) {
+				opcode = builtins[i].opcode;
+				break;
+			}
+		}
+
+		switch(opcode) {
+			case OP_ADD:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+			case OP_LESS:
+			case OP_LESS_EQUAL:
+			case OP_GREATER:
+			case OP_GREATER_EQUAL:
+			case OP_EQUAL:
+			case OP_NOT_EQUAL:
+			{
+				insn.opcode = opcode;
+				emit(&compiler, &insn, 2, 1);
+				break;
+			}
+			case OP_SELECT:
+			{
+				insn.opcode = opcode;
+				emit(&compiler, &insn, 3, 1);
+				break;
+			}
+			case OP_STO:
+			case OP_RCL:
+			{
+				// Registers are only available to calculator programs.
+				if(!calc) {
+					retval = RPNCALC_E_INVALID;
+					break;
+				}
+
+				// The register name is the next token.
+				token = next_token(token + len, &len);
+				if(!token || len >= RPNCALC_NAME_MAX) {
+					retval = RPNCALC_E_INVALID;
+					break;
+				}
+				memcpy(name, token, len);
+				name[len] = 0;
+				if(!valid_name(name)) {
+					retval = RPNCALC_E_INVALID;
+					break;
+				}
+
+				// Resolve the register to its slot, allocating it if needed.
+				insn.slot = find_register(calc, name);
+				if(insn.slot < 0) {
+					if(calc->nregisters == RPNCALC_REGISTERS) {
+						retval = RPNCALC_E_LIMIT;
+						break;
+					}
+					insn.slot = calc->nregisters++;
+					strscpy(calc->registers[insn.slot].name, name, RPNCALC_NAME_MAX);
+					calc->registers[insn.slot].value = 0;
+				}
+
+				insn.opcode = opcode;
+				if(opcode == OP_STO) {
+					emit(&compiler, &insn, 1, 1);
+				} else {
+					emit(&compiler, &insn, 0, 1);
+				}
+				break;
+			}
+			case OP_JZ:
+			case OP_DO:
+			{
+				// Fail if conditionals and loops nest too deeply.
+				if(compiler.nframes == RPNCALC_NEST_DEPTH) {
+					retval = RPNCALC_E_LIMIT;
+					break;
+				}
+
+				// Emit the instruction; its target is patched when the
+				// frame is closed.
+				insn.opcode = opcode;
+				insn.target = -1;
+				emit(&compiler, &insn, 1, 0);
+
+				// Open a frame.
+				frame = &compiler.frames[compiler.nframes++];
+				frame->opcode = opcode;
+				frame->insn = compiler.length - 1;
+				frame->depth = compiler.depth;
+				break;
+			}
+			case OP_JMP:
+			{
+				// "else" must follow "if".
+				frame = compiler.nframes ? &compiler.frames[compiler.nframes - 1] : 0;
+				if(!frame || frame->opcode != OP_JZ) {
+					retval = RPNCALC_E_INVALID;
+					break;
+				}
+
+				// Jump over the second branch, and send "if" to it.
+				insn.opcode = OP_JMP;
+				insn.target = -1;
+				emit(&compiler, &insn, 0, 0);
+				compiler.insns[frame->insn].target = compiler.length;
+
+				// The second branch starts at the same depth as the first.
+				frame->opcode = OP_JMP;
+				frame->insn = compiler.length - 1;
+				frame->branch = compiler.depth;
+				compiler.depth = frame->depth;
+				break;
+			}
+			case OP_THEN:
+			{
+				// "then" must close "if" or "else".
+				frame = compiler.nframes ? &compiler.frames[compiler.nframes - 1] : 0;
+				if(!frame || frame->opcode == OP_DO) {
+					retval = RPNCALC_E_INVALID;
+					break;
+				}
+
+				// Both paths must leave the stack at the same depth.
+				if(compiler.depth != (frame->opcode == OP_JMP ? frame->branch : frame->depth)) {
+					retval = RPNCALC_E_INVALID;
+					break;
+				}
+
+				// Close the frame.
+				compiler.insns[frame->insn].target = compiler.length;
+				compiler.nframes--;
+				break;
+			}
+			case OP_LOOP:
+			{
+				// "loop" must close "do", and the body must leave the stack
+				// unchanged.
+				frame = compiler.nframes ? &compiler.frames[compiler.nframes - 1] : 0;
+				if(!frame || frame->opcode != OP_DO || compiler.depth != frame->depth) {
+					retval = RPNCALC_E_INVALID;
+					break;
+				}
+
+				// Jump back to the start of the body.
+				insn.opcode = OP_LOOP;
+				insn.target = frame->insn + 1;
+				emit(&compiler, &insn, 0, 0);
+
+				// Close the frame.
+				compiler.insns[frame->insn].target = compiler.length;
+				compiler.nframes--;
+				break;
+			}
+			default:
+			{
+				// Numbers push an immediate value.
+				if(parse_number(token, len, &insn.value) == RPNCALC_E_SUCCESS) {
+					insn.opcode = OP_PUSH;
+					emit(&compiler, &insn, 0, 1);
+					break;
+				}
+
+				// Anything else must be a word.
+				callee = get_word(calc, token, len);
+				if(!callee) {
+					retval = RPNCALC_E_INVALID;
+					break;
+				}
+				retval = emit_word(&compiler, callee);
+				break;
+			}
+		}
+	}
+
+	// Every conditional and loop must be closed.
+	if(retval == RPNCALC_E_SUCCESS && compiler.nframes) {
+		retval = RPNCALC_E_INVALID;
+	}
+
+	// Build the program from the instruction buffer.
+	if(retval == RPNCALC_E_SUCCESS) {
+		program = kmalloc(struct_size(program, insns, compiler.length), GFP_KERNEL);
+		if(!program) {
+			retval = RPNCALC_E_NOMEM;
+		}
+	}
+
+	// On failure, drop the references held by emitted calls, and free the
+	// register slots allocated since no program refers to them.
+	if(retval != RPNCALC_E_SUCCESS) {
+		for(i = 0; i < compiler.length; i++) {
+			if(compiler.insns[i].opcode == OP_CALL) {
+				put_program(compiler.insns[i].program);
+			}
+		}
+		if(calc) {
+			calc->nregisters = nregisters;
+		}
+		kfree(compiler.insns);
+		return retval;
+	}
+
+	// Fill in the program.
+	kref_init(&program->ref);
+	program->needs = compiler.needs;
+	program->effect = compiler.depth;
+	program->peak = compiler.peak;
+	program->depth = compiler.calls + 1;
+	program->length = compiler.length;
+	memcpy(program->insns, compiler.insns, compiler.length * sizeof(struct rpncalc_insn));
+
+	kfree(compiler.insns);
+
+	*programp = program;
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static int charge(struct rpncalc_run* state, long steps) {
+
+	// Fail once the budget is used up.
+	state->steps += steps;
+	if(state->steps > state->budget) {
+		return RPNCALC_E_LIMIT;
+	}
+
+	// Give up the CPU if needed every RPNCALC_RESCHED_STEPS instructions.
+	if(state->steps >= state->resched) {
+		cond_resched();
+		state->resched = state->steps + RPNCALC_RESCHED_STEPS;
+	}
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static int run(struct rpncalc* calc, struct rpncalc_program* program, struct rpncalc_run* state) {
+	struct rpncalc_insn* insn;
+	double* values = calc->values;
+	long counters[RPNCALC_NEST_DEPTH];
+	int nloops = 0;
+	int retval;
+	int pc = 0;
+
+	// Charge one pass over the program up front. Only loops run
+	// instructions more than once, so the budget and preemption are
+	// otherwise checked when a loop jumps back.
+	retval = charge(state, program->length);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// The stack depth was checked and room reserved for the program before
+	// running, so the instructions neither check for underflow nor allocate.
+	// Programs only run on double stacks, so operators are applied inline
+	// rather than called through calc->ops.
+	while(pc < program->length) {
+		insn = &program->insns[pc++];
+		switch(insn->opcode) {
+			case OP_PUSH:
+			{
+				values[calc->size++] = insn->value;
+				break;
+			}
+			case OP_RCL:
+			{
+				values[calc->size++] = calc->registers[insn->slot].value;
+				break;
+			}
+			case OP_STO:
+			{
+				calc->registers[insn->slot].value = values[calc->size - 1];
+				break;
+			}
+			case OP_CALL:
+			{
+				retval = run(calc, insn->program, state);
+				if(retval != RPNCALC_E_SUCCESS) {
+					return retval;
+				}
+				break;
+			}
+			case OP_JZ:
+			{
+				if(values[--calc->size] == 0) {
+					pc = insn->target;
+				}
+				break;
+			}
+			case OP_JMP:
+			{
+				pc = insn->target;
+				break;
+			}
+			case OP_ADD:
+			{
+				calc->size--;
+				values[calc->size - 1] += values[calc->size];
+				break;
+			}
+			case OP_SUBTRACT:
+			{
+				calc->size--;
+				values[calc->size - 1] -= values[calc->size];
+				break;
+			}
+			case OP_MULTIPLY:
+			{
+				calc->size--;
+				values[calc->size - 1] *= values[calc->size];
+				break;
+			}
+			case OP_DIVIDE:
+			{
+				calc->size--;
+				values[calc->size - 1] /= values[calc->size];
+				break;
+			}
+			case OP_LESS:
+			{
+				calc->size--;
+				values[calc->size - 1] = values[calc->size - 1] < values[calc->size];
+				break;
+			}
+			case OP_LESS_EQUAL:
+			{
+				calc->size--;
+				values[calc->size - 1] = values[calc->size - 1] <= values[calc->size];
+				break;
+			}
+			case OP_GREATER:
+			{
+				calc->size--;
+				values[calc->size - 1] = values[calc->size - 1] > values[calc->size];
+				break;
+			}
+			case OP_GREATER_EQUAL:
+			{
+				calc->size--;
+				values[calc->size - 1] = values[calc->size - 1] >= values[calc->size];
+				break;
+			}
+			case OP_EQUAL:
+			{
+				calc->size--;
+				values[calc->size - 1] = values[calc->size - 1] == values[calc->size];
+				break;
+			}
+			case OP_NOT_EQUAL:
+			{
+				calc->size--;
+				values[calc->size - 1] = values[calc->size - 1] != values[calc->size];
+				break;
+			}
+			case OP_SELECT:
+			{
+				// The condition is the deepest of the three values.
+				calc->size -= 2;
+				values[calc->size - 1] = values[calc->size - 1] != 0 ? values[calc->size] : values[calc->size + 1];
+				break;
+			}
+			case OP_DO:
+			{
+				// Skip the loop if the count is not positive. Counts past the
+				// budget are clamped, since they can never complete.
+				double count = values[--calc->size];
+
+				if(count >= 1) {
+					counters[nloops++] = count < state->budget ? (long)count : state->budget;
+				} else {
+					pc = insn->target;
+				}
+				break;
+			}
+			case OP_LOOP:
+			{
+				if(--counters[nloops - 1] > 0) {
+					retval = charge(state, pc - insn->target);
+					if(retval != RPNCALC_E_SUCCESS) {
+						return retval;
+					}
+					pc = insn->target;
+				} else {
+					nloops--;
+				}
+				break;
+			}
+		}
+	}
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static void accumulate(double* sum, double* error, double value) {
+	double total = *sum + value;
+
+	// Neumaier summation: keep the low order bits lost by each addition.
+	if((*sum < 0 ? -*sum : *sum) >= (value < 0 ? -value : value)) {
+		*error += (*sum - total) + value;
+	} else {
+		*error += (value - total) + *sum;
+	}
+	*sum = total;
+}
+
+static struct rpncalc_window* new_window(int size, int node) {
+	struct rpncalc_window* window;
+
+	// Allocate the window and its ring buffers on node, charged to the
+	// caller's memory cgroup like stacks, since they grow with the size.
+	window = kzalloc_node(sizeof(struct rpncalc_window), GFP_KERNEL_ACCOUNT, node);
+	if(!window) {
+		return 0;
+	}
+	window->values = kvmalloc_node(array_size(size, sizeof(double)), GFP_KERNEL_ACCOUNT, node);
+	window->min.seqs = kvmalloc_node(array_size(size, sizeof(u64)), GFP_KERNEL_ACCOUNT, node);
+	window->max.seqs = kvmalloc_node(array_size(size, sizeof(u64)), GFP_KERNEL_ACCOUNT, node);
+	if(!window->values || !window->min.seqs || !window->max.seqs) {
+		free_window(window);
+		return 0;
+	}
+	window->size = size;
+
+	return window;
+}
+
+static void free_window(struct rpncalc_window* window) {
+	kvfree(window->values);
+	kvfree(window->min.seqs);
+	kvfree(window->max.seqs);
+	kfree(window);
+}
+
+static void window_add(struct rpncalc_window* window, double value, int sign) {
+	int i;
+
+	// Count infinities and NaNs instead of summing them, so the sum recovers
+	// once they leave the window.
+	if(value != value) {
+		window->nans += sign;
+		return;
+	}
+	if(value - value != 0) {
+		*(value > 0 ? &window->infinities : &window->neg_infinities) += sign;
+		return;
+	}
+	accumulate(&window->sum, &window->error, sign * value);
+
+	// Finite values near the largest double can still overflow the sum.
+	// Subtracting them does not undo that, so recompute the sum from the
+	// window after an eviction instead.
+	if(sign < 0 && window->sum - window->sum != 0) {
+		window->sum = 0;
+		window->error = 0;
+		for(i = 2; i <= window->count; i++) {
+			value = window->values[(window->seq - i) % window->size];
+			if(value - value == 0) {
+				accumulate(&window->sum, &window->error, value);
+			}
+		}
+	}
+}
+
+static void window_push(struct rpncalc_window* window, double value) {
+	struct rpncalc_deque* deque;
+	u64 seq = window->seq++;
+	int size = window->size;
+	int back;
+
+	// Evict the oldest value once the window is full.
+	if(window->count == size) {
+		window_add(window, window->values[seq % size], -1);
+		window->count--;
+		if(window->min.seqs[window->min.head] == seq - size) {
+			window->min.head = (window->min.head + 1) % size;
+			window->min.count--;
+		}
+		if(window->max.seqs[window->max.head] == seq - size) {
+			window->max.head = (window->max.head + 1) % size;
+			window->max.count--;
+		}
+	}
+
+	// Add the new value.
+	window->values[seq % size] = value;
+	window_add(window, value, 1);
+	window->count++;
+
+	// Drop minimum candidates that the new value beats, then append it.
+	deque = &window->min;
+	while(deque->count) {
+		back = (deque->head + deque->count - 1) % size;
+		if(window->values[deque->seqs[back] % size] < value) {
+			break;
+		}
+		deque->count--;
+	}
+	deque->seqs[(deque->head + deque->count++) % size] = seq;
+
+	// Likewise for the maximum.
+	deque = &window->max;
+	while(deque->count) {
+		back = (deque->head + deque->count - 1) % size;
+		if(window->values[deque->seqs[back] % size] > value) {
+			break;
+		}
+		deque->count--;
+	}
+	deque->seqs[(deque->head + deque->count++) % size] = seq;
+}
+
+static double window_sum(struct rpncalc_window* window) {
+
+	// NaNs, or infinities of both signs, make the sum NaN, and infinities
+	// of one sign make it that infinity.
+	if(window->nans || (window->infinities && window->neg_infinities)) {
+		return __builtin_nan("");
+	}
+	if(window->infinities) {
+		return __builtin_inf();
+	}
+	if(window->neg_infinities) {
+		return -__builtin_inf();
+	}
+
+	// Once the finite values overflow, the rounding error is meaningless.
+	if(window->sum - window->sum != 0) {
+		return window->sum;
+	}
+
+	return window->sum + window->error;
+}
+
+static int window_stat(struct rpncalc_window* window, int stat, double* valuep) {
+
+	// The count and sum are defined for an empty window.
+	switch(stat) {
+		case RPNCALC_STAT_COUNT:
+		{
+			*valuep = window->count;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_SUM:
+		{
+			*valuep = window_sum(window);
+			return RPNCALC_E_SUCCESS;
+		}
+	}
+
+	// The rest need at least one value.
+	if(!window->count) {
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	switch(stat) {
+		case RPNCALC_STAT_MEAN:
+		{
+			*valuep = window_sum(window) / window->count;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_MIN:
+		{
+			*valuep = window->values[window->min.seqs[window->min.head] % window->size];
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_MAX:
+		{
+			*valuep = window->values[window->max.seqs[window->max.head] % window->size];
+			return RPNCALC_E_SUCCESS;
+		}
+	}
+
+	return RPNCALC_E_INVALID;
+}
+
+static void accum_push(struct rpncalc_accum* accum, double value) {
+	double delta = value - accum->mean;
+
+	// The first value starts every statistic.
+	if(!accum->count) {
+		accum->min = value;
+		accum->max = value;
+		accum->ema = value;
+	}
+
+	// Update the mean and squared deviations (Welford).
+	accum->count++;
+	accum->mean += delta / accum->count;
+	accum->m2 += delta * (value - accum->mean);
+
+	// Update the extremes and moving average.
+	accum->min = value < accum->min ? value : accum->min;
+	accum->max = value > accum->max ? value : accum->max;
+	accum->ema += accum->alpha * (value - accum->ema);
+}
+
+static void accum_merge(struct rpncalc_accum* dst, struct rpncalc_accum* src) {
+	double delta = src->mean - dst->mean;
+	u64 count = dst->count + src->count;
+	double alpha;
+
+	// Nothing to merge from an empty source.
+	if(!src->count) {
+		return;
+	}
+
+	// An empty destination takes the source's statistics, keeping its own
+	// smoothing factor.
+	if(!dst->count) {
+		alpha = dst->alpha;
+		*dst = *src;
+		dst->alpha = alpha;
+		return;
+	}
+
+	// Combine the means and squared deviations (Chan et al.).
+	dst->m2 += src->m2 + delta * delta * ((double)dst->count * src->count / count);
+	dst->mean += delta * ((double)src->count / count);
+	dst->count = count;
+
+	// Combine the extremes.
+	dst->min = src->min < dst->min ? src->min : dst->min;
+	dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+static int accum_stat(struct rpncalc_accum* accum, int stat, double* valuep) {
+
+	// The count and sum are defined without values.
+	switch(stat) {
+		case RPNCALC_STAT_COUNT:
+		{
+			*valuep = accum->count;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_SUM:
+		{
+			*valuep = accum->mean * accum->count;
+			return RPNCALC_E_SUCCESS;
+		}
+	}
+
+	// The rest need at least one value, and the sample variance two.
+	if(!accum->count || (stat == RPNCALC_STAT_SAMPLE_VARIANCE && accum->count < 2)) {
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	switch(stat) {
+		case RPNCALC_STAT_MEAN:
+		{
+			*valuep = accum->mean;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_MIN:
+		{
+			*valuep = accum->min;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_MAX:
+		{
+			*valuep = accum->max;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_VARIANCE:
+		{
+			*valuep = accum->m2 / accum->count;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_SAMPLE_VARIANCE:
+		{
+			*valuep = accum->m2 / (accum->count - 1);
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_EMA:
+		{
+			*valuep = accum->ema;
+			return RPNCALC_E_SUCCESS;
+		}
+	}
+
+	return RPNCALC_E_INVALID;
+}
+
+static double power_of_two(int exponent) {
+	u64 bits;
+	double value;
+
+	// Build 2^exponent directly from its bits, for normal exponents.
+	bits = (u64)(exponent + 1023) << 52;
+	memcpy(&value, &bits, sizeof(value));
+
+	return value;
+}
+
+static double logarithm(double x) {
+	const double ln2 = 0.69314718055994530942;
+	double m;
+	double s;
+	double s2;
+	double term;
+	double sum;
+	u64 bits;
+	int exponent;
+	int k;
+
+	// Scale subnormals up so the exponent field is meaningful.
+	exponent = 0;
+	if(x < 0x1p-1022) {
+		x *= 0x1p54;
+		exponent = -54;
+	}
+
+	// Split x into m * 2^exponent with m in [sqrt(1/2), sqrt(2)).
+	memcpy(&bits, &x, sizeof(bits));
+	exponent += (int)((bits >> 52) & 0x7ff) - 1023;
+	bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+	memcpy(&m, &bits, sizeof(m));
+	if(m > 1.41421356237309504880) {
+		m /= 2;
+		exponent++;
+	}
+
+	// ln(m) = 2 atanh(s) with s = (m - 1) / (m + 1), |s| < 0.172.
+	s = (m - 1) / (m + 1);
+	s2 = s * s;
+	term = s;
+	sum = s;
+	for(k = 3; k <= 27; k += 2) {
+		term *= s2;
+		sum += term / k;
+	}
+
+	return exponent * ln2 + 2 * sum;
+}
+
+static double exponential(double x) {
+	const double ln2hi = 6.93147180369123816490e-01;
+	const double ln2lo = 1.90821492927058770002e-10;
+	double r;
+	double term;
+	double sum;
+	int n;
+	int k;
+
+	// Saturate outside the range of doubles.
+	if(x > 709.78) {
+		return power_of_two(1023) * 2;
+	}
+	if(x < -745.2) {
+		return 0;
+	}
+
+	// Reduce to e^x = 2^n * e^r with |r| <= ln(2) / 2.
+	n = (int)(x / ln2hi + (x < 0 ? -0.5 : 0.5));
+	r = (x - n * ln2hi) - n * ln2lo;
+
+	// Taylor series of e^r.
+	term = 1;
+	sum = 1;
+	for(k = 1; k <= 17; k++) {
+		term *= r / k;
+		sum += term;
+	}
+
+	// Scale by 2^n in two steps so subnormal results are reached.
+	if(n < -1000) {
+		return sum * power_of_two(n + 1000) * power_of_two(-1000);
+	}
+	if(n > 1000) {
+		return sum * power_of_two(n - 1000) * power_of_two(1000);
+	}
+	return sum * power_of_two(n);
+}
+
+static void store_add(struct rpncalc_store* store, int index, u64 count) {
+	u64 collapsed = 0;
+	int offset;
+	int shift;
+	int lo;
+	int hi;
+	int i;
+
+	if(!store->total) {
+
+		// Center the first bucket in the store.
+		store->offset = index - RPNCALC_SKETCH_BINS / 2;
+		store->lo = index;
+		store->hi = index;
+	} else if(index < store->lo || index > store->hi) {
+		lo = min(index, store->lo);
+		hi = max(index, store->hi);
+
+		// If the range no longer fits, merge the lowest buckets into the
+		// lowest one that is kept.
+		if(hi - lo >= RPNCALC_SKETCH_BINS) {
+			lo = hi - RPNCALC_SKETCH_BINS + 1;
+			for(i = store->lo; i < lo && i <= store->hi; i++) {
+				collapsed += store->counts[i - store->offset];
+				store->counts[i - store->offset] = 0;
+			}
+		}
+
+		// Move the buckets if the range runs off either end of the store.
+		if(lo < store->offset || hi >= store->offset + RPNCALC_SKETCH_BINS) {
+			offset = lo - (RPNCALC_SKETCH_BINS - (hi - lo + 1)) / 2;
+			shift = store->offset - offset;
+			if(shift >= RPNCALC_SKETCH_BINS || -shift >= RPNCALC_SKETCH_BINS) {
+				memset(store->counts, 0, sizeof(store->counts));
+			} else if(shift > 0) {
+				memmove(store->counts + shift, store->counts, (RPNCALC_SKETCH_BINS - shift) * sizeof(u64));
+				memset(store->counts, 0, shift * sizeof(u64));
+			} else {
+				memmove(store->counts, store->counts - shift, (RPNCALC_SKETCH_BINS + shift) * sizeof(u64));
+				memset(store->counts + RPNCALC_SKETCH_BINS + shift, 0, -shift * sizeof(u64));
+			}
+			store->offset = offset;
+		}
+
+		store->lo = lo;
+		store->hi = hi;
+		store->counts[lo - store->offset] += collapsed;
+	}
+
+	// Values below a merged range count in its lowest bucket.
+	if(index < store->lo) {
+		index = store->lo;
+	}
+
+	store->counts[index - store->offset] += count;
+	store->total += count;
+}
+
+static void store_merge(struct rpncalc_store* dst, struct rpncalc_store* src) {
+	int i;
+
+	// Add the source buckets from the top down, so that if they need to be
+	// merged it happens once.
+	for(i = src->hi; src->total && i >= src->lo; i--) {
+		if(src->counts[i - src->offset]) {
+			store_add(dst, i, src->counts[i - src->offset]);
+		}
+	}
+}
+
+static void quantile_push(struct rpncalc_quantile* sketch, double value) {
+	double magnitude = value < 0 ? -value : value;
+	int index;
+
+	// Ignore infinities and NaNs.
+	if(!(magnitude <= 0x1.fffffffffffffp1023)) {
+		return;
+	}
+
+	// Track the exact extremes and sum.
+	if(!sketch->positive.total && !sketch->negative.total && !sketch->zeros) {
+		sketch->min = value;
+		sketch->max = value;
+	}
+	sketch->min = value < sketch->min ? value : sketch->min;
+	sketch->max = value > sketch->max ? value : sketch->max;
+	sketch->sum += value;
+
+	// Count zeros on their own.
+	if(magnitude == 0) {
+		sketch->zeros++;
+		return;
+	}
+
+	// Bucket i holds magnitudes in (gamma^(i-1), gamma^i], so i is the
+	// ceiling of log_gamma(magnitude), computed as -floor(-x) with the
+	// argument biased positive so that truncation floors.
+	index = (1 << 30) - (int)((1 << 30) - logarithm(magnitude) / sketch->lngamma);
+	if(value > 0) {
+		store_add(&sketch->positive, index, 1);
+	} else {
+		store_add(&sketch->negative, index, 1);
+	}
+}
+
+static void quantile_merge(struct rpncalc_quantile* dst, struct rpncalc_quantile* src) {
+	u64 count = src->positive.total + src->negative.total + src->zeros;
+
+	// Nothing to merge from an empty source.
+	if(!count) {
+		return;
+	}
+
+	// Combine the extremes and sum.
+	if(!dst->positive.total && !dst->negative.total && !dst->zeros) {
+		dst->min = src->min;
+		dst->max = src->max;
+	}
+	dst->min = src->min < dst->min ? src->min : dst->min;
+	dst->max = src->max > dst->max ? src->max : dst->max;
+	dst->sum += src->sum;
+
+	// Combine the buckets.
+	dst->zeros += src->zeros;
+	store_merge(&dst->positive, &src->positive);
+	store_merge(&dst->negative, &src->negative);
+}
+
+static int quantile_stat(struct rpncalc_quantile* sketch, int stat, double* valuep) {
+	u64 count = sketch->positive.total + sketch->negative.total + sketch->zeros;
+
+	// The count and sum are defined without values.
+	switch(stat) {
+		case RPNCALC_STAT_COUNT:
+		{
+			*valuep = count;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_SUM:
+		{
+			*valuep = sketch->sum;
+			return RPNCALC_E_SUCCESS;
+		}
+	}
+
+	// The rest need at least one value.
+	if(!count) {
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	switch(stat) {
+		case RPNCALC_STAT_MEAN:
+		{
+			*valuep = sketch->sum / count;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_MIN:
+		{
+			*valuep = sketch->min;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_MAX:
+		{
+			*valuep = sketch->max;
+			return RPNCALC_E_SUCCESS;
+		}
+	}
+
+	return RPNCALC_E_INVALID;
+}
+
+static double quantile_value(struct rpncalc_quantile* sketch, double q) {
+	struct rpncalc_store* store;
+	u64 count = sketch->positive.total + sketch->negative.total + sketch->zeros;
+	double rank = q * (count - 1);
+	double value;
+	u64 seen = 0;
+	int i;
+
+	// The extremes are known exactly.
+	if(q == 0) {
+		return sketch->min;
+	}
+	if(q == 1) {
+		return sketch->max;
+	}
+
+	// Walk the negative buckets from the most negative value up.
+	store = &sketch->negative;
+	for(i = store->hi; store->total && i >= store->lo; i--) {
+		seen += store->counts[i - store->offset];
+		if(seen > rank) {
+			value = -2 * exponential(i * sketch->lngamma) / (1 + sketch->gamma);
+			goto found;
+		}
+	}
+
+	// Then the zeros.
+	seen += sketch->zeros;
+	if(seen > rank) {
+		return 0;
+	}
+
+	// Then the positive buckets up to the largest value. Each bucket is
+	// represented by the value within the accuracy of both its bounds.
+	store = &sketch->positive;
+	for(i = store->lo; i < store->hi; i++) {
+		seen += store->counts[i - store->offset];
+		if(seen > rank) {
+			break;
+		}
+	}
+	value = 2 * exponential(i * sketch->lngamma) / (1 + sketch->gamma);
+
+found:
+	// The exact extremes are known, so never go past them.
+	value = value < sketch->min ? sketch->min : value;
+	value = value > sketch->max ? sketch->max : value;
+
+	return value;
+}
+
+static u64 hash_value(double value) {
+	u64 bits;
+
+	// Hash +0 and -0 alike.
+	if(value == 0) {
+		value = 0;
+	}
+
+	// Mix the bits (splitmix64 finalizer).
+	memcpy(&bits, &value, sizeof(bits));
+	bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	bits = (bits ^ (bits >> 27)) * 0x94d049bb133111ebULL;
+
+	return bits ^ (bits >> 31);
+}
+
+static void hll_push(struct rpncalc_hll* hll, double value) {
+	u64 hash = hash_value(value);
+	u64 rest = hash << RPNCALC_HLL_BITS;
+	int rank;
+
+	// The top bits pick a register, which keeps the longest run of leading
+	// zeros seen in the rest of the hash.
+	rank = rest ? __builtin_clzll(rest) + 1 : 64 - RPNCALC_HLL_BITS + 1;
+	if(rank > hll->registers[hash >> (64 - RPNCALC_HLL_BITS)]) {
+		hll->registers[hash >> (64 - RPNCALC_HLL_BITS)] = rank;
+	}
+	hll->count++;
+}
+
+static void hll_merge(struct rpncalc_hll* dst, struct rpncalc_hll* src) {
+	int i;
+
+	// The union of two sketches keeps the larger of each register.
+	for(i = 0; i < ARRAY_SIZE(dst->registers); i++) {
+		dst->registers[i] = max(dst->registers[i], src->registers[i]);
+	}
+	dst->count += src->count;
+}
+
+static int hll_stat(struct rpncalc_hll* hll, int stat, double* valuep) {
+	const double m = ARRAY_SIZE(hll->registers);
+	double sum = 0;
+	double estimate;
+	int zeros = 0;
+	int i;
+
+	switch(stat) {
+		case RPNCALC_STAT_COUNT:
+		{
+			*valuep = hll->count;
+			return RPNCALC_E_SUCCESS;
+		}
+		case RPNCALC_STAT_DISTINCT:
+		{
+			// Harmonic mean of the register estimates.
+			for(i = 0; i < ARRAY_SIZE(hll->registers); i++) {
+				sum += power_of_two(-hll->registers[i]);
+				zeros += !hll->registers[i];
+			}
+			estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+			// Use linear counting while many registers are empty.
+			if(estimate <= 2.5 * m && zeros) {
+				estimate = m * logarithm(m / zeros);
+			}
+
+			*valuep = estimate;
+			return RPNCALC_E_SUCCESS;
+		}
+	}
+
+	return RPNCALC_E_INVALID;
+}
+
+static void fold(struct rpncalc* calc, double value) {
+	switch(calc->kind) {
+		case KIND_WINDOW:
+		{
+			window_push(calc->window, value);
+			break;
+		}
+		case KIND_ACCUM:
+		{
+			accum_push(calc->accum, value);
+			break;
+		}
+		case KIND_QUANTILE:
+		{
+			quantile_push(calc->quantile, value);
+			break;
+		}
+		case KIND_DISTINCT:
+		{
+			hll_push(calc->hll, value);
+			break;
+		}
+	}
+}
+
+static int before(double a, double b) {
+
+	// Order values ascending, with NaNs after everything else.
+	return a < b || (b != b && a == a);
+}
+
+static void sift(double* values, int root, int count) {
+	double value = values[root];
+	int child;
+
+	// Move the root down the max heap until both children are not larger.
+	while((child = 2 * root + 1) < count) {
+		if(child + 1 < count && before(values[child], values[child + 1])) {
+			child++;
+		}
+		if(!before(value, values[child])) {
+			break;
+		}
+		values[root] = values[child];
+		root = child;
+	}
+	values[root] = value;
+}
+
+static void heap_sort(double* values, int count, struct rpncalc_run* state) {
+	int i;
+
+	// Build a max heap.
+	for(i = count / 2 - 1; i >= 0; i--) {
+		sift(values, i, count);
+		charge(state, 1);
+	}
+
+	// Repeatedly move the largest value to the end.
+	for(i = count - 1; i > 0; i--) {
+		swap(values[0], values[i]);
+		sift(values, 0, i);
+		charge(state, 1);
+	}
+}
+
+static void insertion_sort(double* values, int count) {
+	double value;
+	int i;
+	int j;
+
+	for(i = 1; i < count; i++) {
+		value = values[i];
+		for(j = i; j > 0 && before(value, values[j - 1]); j--) {
+			values[j] = values[j - 1];
+		}
+		values[j] = value;
+	}
+}
+
+static int partition(double* values, int count, struct rpncalc_run* state) {
+	double pivot;
+	int mid = count / 2;
+	int i = 0;
+	int j = count - 1;
+
+	// Order the first, middle and last values and use the middle one as the
+	// pivot. The outer two then stop both scans without bounds checks.
+	if(before(values[mid], values[0])) {
+		swap(values[mid], values[0]);
+	}
+	if(before(values[j], values[mid])) {
+		swap(values[j], values[mid]);
+		if(before(values[mid], values[0])) {
+			swap(values[mid], values[0]);
+		}
+	}
+	pivot = values[mid];
+
+	// Hoare partition: swap values from either end that are on the wrong
+	// side until the scans meet.
+	for(;;) {
+		do {
+			i++;
+		} while(before(values[i], pivot));
+		do {
+			j--;
+		} while(before(pivot, values[j]));
+		if(i >= j) {
+			break;
+		}
+		swap(values[i], values[j]);
+	}
+
+	charge(state, count);
+
+	// Values before i are no larger than the pivot, and the rest no smaller.
+	return i;
+}
+
+static void sort_values(double* values, int count, struct rpncalc_run* state) {
+	int limit = 2 * ilog2(count | 1);
+	int split;
+
+	// Introsort: quicksort, recursing into the smaller part so the stack
+	// stays logarithmic, and falling back to heapsort if the partitions
+	// keep coming out lopsided.
+	while(count > RPNCALC_SORT_SMALL) {
+		if(limit-- == 0) {
+			heap_sort(values, count, state);
+			return;
+		}
+		split = partition(values, count, state);
+		if(split < count - split) {
+			sort_values(values, split, state);
+			values += split;
+			count -= split;
+		} else {
+			sort_values(values + split, count - split, state);
+			count = split;
+		}
+	}
+
+	insertion_sort(values, count);
+}
+
+static void select_value(double* values, int count, int rank, struct rpncalc_run* state) {
+	int limit = 2 * ilog2(count | 1);
+	int split;
+
+	// Introselect: partition and keep only the part holding rank, falling
+	// back to heapsort if the partitions keep coming out lopsided.
+	while(count > RPNCALC_SORT_SMALL) {
+		if(limit-- == 0) {
+			heap_sort(values, count, state);
+			return;
+		}
+		split = partition(values, count, state);
+		if(rank < split) {
+			count = split;
+		} else {
+			values += split;
+			count -= split;
+			rank -= split;
+		}
+	}
+
+	insertion_sort(values, count);
+}
+
+static double smallest(double* values, int count) {
+	double value = values[0];
+	int i;
+
+	for(i = 1; i < count; i++) {
+		if(before(values[i], value)) {
+			value = values[i];
+		}
+	}
+
+	return value;
+}
+
+static int lock_top(int handle, int count, int types, struct rpncalc** calcp) {
+	struct rpncalc* calc;
+	int retval;
+
+	// Make sure count is valid.
+	if(count < 1) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure the stack holds one of the types the operator supports.
+	if(!(TYPE_BIT(calc->ops->type) & types)) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Make sure there are enough values on the stack.
+	if(calc->size < count) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INSUFFICIENT;
+	}
+
+	*calcp = calc;
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static void vector_begin(void) {
+
+	// The kernels may use vector registers, which the kernel only saves for
+	// code between these calls. Preemption is off until vector_end(), so
+	// callers keep each section to a bounded amount of work.
+#ifdef CONFIG_X86_64
+	kernel_fpu_begin();
+#endif
+}
+
+static void vector_end(void) {
+#ifdef CONFIG_X86_64
+	kernel_fpu_end();
+#endif
+}
+
+#define KERNEL(name) name##_generic
+#define KERNEL_TARGET
+#include "rpncalc_kernels.h"
+#undef KERNEL_TARGET
+#undef KERNEL
+
+#ifdef CONFIG_X86_64
+#define KERNEL(name) name##_avx2
+#define KERNEL_TARGET __attribute__((target("avx2,fma")))
+#include "rpncalc_kernels.h"
+#undef KERNEL_TARGET
+#undef KERNEL
+
+#define KERNEL(name) name##_avx512
+#define KERNEL_TARGET __attribute__((target("avx512f,avx512vl,fma")))
+#include "rpncalc_kernels.h"
+#undef KERNEL_TARGET
+#undef KERNEL
+
+static int avx2_usable(void) {
+	return boot_cpu_has(X86_FEATURE_AVX2) && boot_cpu_has(X86_FEATURE_FMA) &&
+		cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, 0);
+}
+
+static int avx512_usable(void) {
+	return avx2_usable() && boot_cpu_has(X86_FEATURE_AVX512F) && boot_cpu_has(X86_FEATURE_AVX512VL) &&
+		cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM | XFEATURE_MASK_AVX512, 0);
+}
+#endif
+
+// Implementations of the bulk kernels, best first.
+static const struct {
+	const char* name;
+	int (*usable)(void);				// Whether the CPU can run them, or NULL if always.
+	void (*prefix_sum)(double* values, int count, double carry);
+	double (*dot_product)(const double* x, const double* y, int count);
+	void (*prefix_sum_float)(float* values, int count, float carry);
+	float (*dot_product_float)(const float* x, const float* y, int count);
+	double (*polynomial)(const double* coefficients, int count, double x, double carry);
+	void (*matrix_tile)(const double* a, const double* b, double* c, int rows, int inner, int cols, int astride, int stride);
+} kernel_sets[] = {
+#ifdef CONFIG_X86_64
+	{ "avx512", avx512_usable, prefix_sum_avx512, dot_product_avx512, prefix_sum_float_avx512, dot_product_float_avx512, polynomial_avx512, matrix_tile_avx512 },
+	{ "avx2", avx2_usable, prefix_sum_avx2, dot_product_avx2, prefix_sum_float_avx2, dot_product_float_avx2, polynomial_avx2, matrix_tile_avx2 },
+#endif
+	{ "generic", 0, prefix_sum_generic, dot_product_generic, prefix_sum_float_generic, dot_product_float_generic, polynomial_generic, matrix_tile_generic },
+};
+
+static void select_kernels(void) {
+	int best = -1;
+	int i;
+
+	// Take the first implementation the CPU supports, or the one asked for
+	// if the CPU supports that.
+	for(i = 0; i < ARRAY_SIZE(kernel_sets); i++) {
+		if(kernel_sets[i].usable && !kernel_sets[i].usable()) {
+			if(!strcmp(kernels, kernel_sets[i].name)) {
+				pr_warn("rpncalc: %s kernels not supported by this CPU\n", kernels);
+			}
+			continue;
+		}
+		if(best < 0 || !strcmp(kernels, kernel_sets[i].name)) {
+			best = i;
+		}
+	}
+
+	// Point the static calls at it, so no call checks the CPU again.
+	static_call_update(rpncalc_prefix_sum, kernel_sets[best].prefix_sum);
+	static_call_update(rpncalc_dot_product, kernel_sets[best].dot_product);
+	static_call_update(rpncalc_prefix_sum_float, kernel_sets[best].prefix_sum_float);
+	static_call_update(rpncalc_dot_product_float, kernel_sets[best].dot_product_float);
+	static_call_update(rpncalc_polynomial, kernel_sets[best].polynomial);
+	static_call_update(rpncalc_matrix_tile, kernel_sets[best].matrix_tile);
+	pr_info("rpncalc: using %s kernels\n", kernel_sets[best].name);
+}
+
+static double polynomial(const double* coefficients, int count, double x) {
+	double value = 0;
+	int done;
+	int n;
+
+	// Evaluate a chunk of coefficients at a time, highest degree first, each
+	// in its own FPU section, carrying the value so far into the next.
+	for(done = 0; done < count; done += n) {
+		n = min(count - done, RPNCALC_VECTOR_CHUNK);
+		vector_begin();
+		value = static_call(rpncalc_polynomial)(coefficients + done, n, x, value);
+		vector_end();
+		cond_resched();
+	}
+
+	return value;
+}
+
+static int matrix_size(int rows, int cols, int* sizep) {
+
+	// Make sure the dimensions are positive and the matrix fits in a stack.
+	if(rows < 1 || cols < 1 || check_mul_overflow(rows, cols, sizep)) {
+		return RPNCALC_E_INVALID;
+	}
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static void matrix_multiply(const double* a, const double* b, double* c, int rows, int inner, int cols, struct rpncalc_run* state) {
+	int ii, kk, jj;
+	int iend, kend, jend;
+
+	memset(c, 0, (size_t)rows * cols * sizeof(double));
+
+	// Work through tiles so the rows of b and c in use stay in cache. Each
+	// tile gets its own FPU section, and is charged outside it, where
+	// giving up the CPU is allowed.
+	for(ii = 0; ii < rows; ii += RPNCALC_BLOCK) {
+		iend = min(ii + RPNCALC_BLOCK, rows);
+		for(kk = 0; kk < inner; kk += RPNCALC_BLOCK) {
+			kend = min(kk + RPNCALC_BLOCK, inner);
+			for(jj = 0; jj < cols; jj += RPNCALC_BLOCK) {
+				jend = min(jj + RPNCALC_BLOCK, cols);
+				vector_begin();
+				static_call(rpncalc_matrix_tile)(a + (size_t)ii * inner + kk, b + (size_t)kk * cols + jj,
+					c + (size_t)ii * cols + jj, iend - ii, kend - kk, jend - jj, inner, cols);
+				vector_end();
+				charge(state, (long)(iend - ii) * (kend - kk) * (jend - jj) / RPNCALC_BLOCK);
+			}
+		}
+	}
+}
+
+static void matrix_transpose(const double* m, double* t, int rows, int cols) {
+	int ii, jj;
+	int i, j;
+	int iend, jend;
+
+	// Work through tiles so both the rows read and the columns written stay
+	// in cache.
+	for(ii = 0; ii < rows; ii += RPNCALC_BLOCK) {
+		iend = min(ii + RPNCALC_BLOCK, rows);
+		for(jj = 0; jj < cols; jj += RPNCALC_BLOCK) {
+			jend = min(jj + RPNCALC_BLOCK, cols);
+			for(i = ii; i < iend; i++) {
+				for(j = jj; j < jend; j++) {
+					t[(size_t)j * rows + i] = m[(size_t)i * cols + j];
+				}
+			}
+		}
+	}
+}
+
+static int eliminate(double* a, double* b, int n, int cols, double* detp, struct rpncalc_run* state) {
+	double* prow;
+	double* row;
+	double det = 1;
+	double best;
+	double magnitude;
+	double scale;
+	int pivot;
+	int i, k, j;
+
+	for(k = 0; k < n; k++) {
+		prow = a + (size_t)k * n;
+
+		// Pick the largest remaining value in the column as the pivot.
+		pivot = k;
+		best = prow[k] < 0 ? -prow[k] : prow[k];
+		for(i = k + 1; i < n; i++) {
+			magnitude = a[(size_t)i * n + k];
+			magnitude = magnitude < 0 ? -magnitude : magnitude;
+			if(magnitude > best) {
+				best = magnitude;
+				pivot = i;
+			}
+		}
+
+		// A zero column means the matrix is singular.
+		if(best == 0) {
+			*detp = 0;
+			return RPNCALC_E_INVALID;
+		}
+
+		// Swap the pivot row into place, in both a and b.
+		if(pivot != k) {
+			row = a + (size_t)pivot * n;
+			for(j = k; j < n; j++) {
+				swap(prow[j], row[j]);
+			}
+			for(j = 0; j < cols; j++) {
+				swap(b[(size_t)k * cols + j], b[(size_t)pivot * cols + j]);
+			}
+			det = -det;
+		}
+		det *= prow[k];
+
+		// Subtract multiples of the pivot row from the rows below it. Only
+		// the upper triangle of a is needed afterwards.
+		for(i = k + 1; i < n; i++) {
+			row = a + (size_t)i * n;
+			scale = row[k] / prow[k];
+			for(j = k + 1; j < n; j++) {
+				row[j] -= scale * prow[j];
+			}
+			for(j = 0; j < cols; j++) {
+				b[(size_t)i * cols + j] -= scale * b[(size_t)k * cols + j];
+			}
+		}
+
+		charge(state, (long)(n - k) * (n - k + cols) / RPNCALC_BLOCK);
+	}
+
+	*detp = det;
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static void back_substitute(const double* u, double* b, int n, int cols, struct rpncalc_run* state) {
+	const double* urow;
+	double* brow;
+	double scale;
+	int i, k, j;
+
+	// Solve for the rows of x from the bottom up, overwriting b. Each step
+	// subtracts a multiple of an already solved row, a contiguous loop.
+	for(i = n - 1; i >= 0; i--) {
+		urow = u + (size_t)i * n;
+		brow = b + (size_t)i * cols;
+		for(k = i + 1; k < n; k++) {
+			scale = urow[k];
+			for(j = 0; j < cols; j++) {
+				brow[j] -= scale * b[(size_t)k * cols + j];
+			}
+		}
+		for(j = 0; j < cols; j++) {
+			brow[j] /= urow[i];
+		}
+
+		charge(state, (long)(n - i) * cols / RPNCALC_BLOCK);
+	}
+}
+
+static double square_root(double x) {
+	double y;
+	u64 bits;
+	int i;
+
+	// Zero, infinity and NaN are their own roots, and negatives have none.
+	if(x == 0 || x != x || x > 1.7976931348623157e308) {
+		return x;
+	}
+	if(x < 0) {
+		return (x - x) / (x - x);
+	}
+
+	// Scale subnormals up so halving the exponent gives a good estimate.
+	if(x < 0x1p-1022) {
+		return square_root(x * 0x1p108) * 0x1p-54;
+	}
+
+	// Halve the exponent for an estimate within 6%, then refine it with
+	// Newton's method, which doubles the correct bits each step.
+	memcpy(&bits, &x, sizeof(bits));
+	bits = (bits >> 1) + 0x1ff8000000000000ULL;
+	memcpy(&y, &bits, sizeof(y));
+	for(i = 0; i < 5; i++) {
+		y = (y + x / y) / 2;
+	}
+
+	return y;
+}
+
+static double magnitude(double re, double im) {
+	double big;
+	double small;
+	double ratio;
+
+	big = re < 0 ? -re : re;
+	small = im < 0 ? -im : im;
+	if(small > big) {
+		swap(big, small);
+	}
+
+	// Infinities win over NaNs, and zero has no ratio.
+	if(big > 1.7976931348623157e308) {
+		return big;
+	}
+	if(small == 0 || small != small) {
+		return big + small;
+	}
+
+	// Scale by the larger part so squaring cannot overflow or underflow.
+	ratio = small / big;
+
+	return big * square_root(1 + ratio * ratio);
+}
+
+static double arctangent(double y, double x) {
+	const double pi = 3.14159265358979323846;
+	const double tan_pi_8 = 0.41421356237309504880;
+	double t;
+	double t2;
+	double sum;
+	double offset = 0;
+	int swapped = 0;
+	int k;
+
+	// Propagate NaNs.
+	if(x != x || y != y) {
+		return x + y;
+	}
+
+	// Reduce to the first octant: 0 <= t = small / big <= 1.
+	t = (y < 0 ? -y : y);
+	t2 = (x < 0 ? -x : x);
+	if(t > t2) {
+		swap(t, t2);
+		swapped = 1;
+	}
+	if(t2 == 0) {
+		t = 0;
+	} else if(t2 > 1.7976931348623157e308) {
+		t = t > 1.7976931348623157e308 ? 1 : 0;
+	} else {
+		t = t / t2;
+	}
+
+	// Shift by pi/4 so the series only sees |t| <= tan(pi/8).
+	if(t > tan_pi_8) {
+		t = (t - 1) / (t + 1);
+		offset = pi / 4;
+	}
+
+	// atan(t) = t - t^3/3 + t^5/5 - ..., with t^2 <= 0.172.
+	t2 = t * t;
+	sum = 0;
+	for(k = 47; k >= 3; k -= 2) {
+		sum = (k % 4 == 3 ? -1.0 : 1.0) / k + t2 * sum;
+	}
+	sum = offset + t + t * t2 * sum;
+
+	// Unfold the octant into the full circle. Signed zeros count as
+	// negative, so the phase of -1 - 0i is -pi.
+	if(swapped) {
+		sum = pi / 2 - sum;
+	}
+	if(sign_bit(x)) {
+		sum = pi - sum;
+	}
+
+	return sign_bit(y) ? -sum : sum;
+}
+
+static int sign_bit(double x) {
+	u64 bits;
+
+	memcpy(&bits, &x, sizeof(bits));
+
+	return bits >> 63;
+}
+
+static struct rpncalc_complex complex_product(struct rpncalc_complex a, struct rpncalc_complex b) {
+	struct rpncalc_complex result;
+
+	result.re = a.re * b.re - a.im * b.im;
+	result.im = a.re * b.im + a.im * b.re;
+
+	return result;
+}
+
+static struct rpncalc_complex complex_quotient(struct rpncalc_complex a, struct rpncalc_complex b) {
+	struct rpncalc_complex result;
+	double ratio;
+	double scale;
+
+	// Smith's algorithm: divide through by the larger part of b so the
+	// intermediate products cannot overflow.
+	if((b.re < 0 ? -b.re : b.re) >= (b.im < 0 ? -b.im : b.im)) {
+		ratio = b.im / b.re;
+		scale = b.re + b.im * ratio;
+		result.re = (a.re + a.im * ratio) / scale;
+		result.im = (a.im - a.re * ratio) / scale;
+	} else {
+		ratio = b.re / b.im;
+		scale = b.re * ratio + b.im;
+		result.re = (a.re * ratio + a.im) / scale;
+		result.im = (a.im * ratio - a.re) / scale;
+	}
+
+	return result;
+}
+
+static struct rpncalc_complex complex_unary(char op, struct rpncalc_complex a) {
+	struct rpncalc_complex result;
+
+	switch(op) {
+		case 'c':
+			result.re = a.re;
+			result.im = -a.im;
+			break;
+		case 'a':
+			result.re = magnitude(a.re, a.im);
+			result.im = 0;
+			break;
+		default:
+			result.re = arctangent(a.im, a.re);
+			result.im = 0;
+			break;
+	}
+
+	return result;
+}
+
+static int lock_integers(int handle, struct rpncalc** calcp) {
+	struct rpncalc* calc;
+	int retval;
+
+	// Lock the calculator table.
+	mutex_lock(&calcs_lock);
+
+	// Look up calculator.
+	calc = get_rpncalc(handle);
+	if(!calc) {
+		mutex_unlock(&calcs_lock);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Unlock the calculator table.
+	mutex_unlock(&calcs_lock);
+
+	// Lock the calculator, unpacking its stack if it was idle.
+	retval = lock_stack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		return retval;
+	}
+
+	// Make sure the stack holds integers.
+	if(calc->ops->type != TYPE_INT128 && calc->ops->type != TYPE_DECIMAL) {
+		unlock_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	*calcp = calc;
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static void to_digits(u32* digits, u128 value) {
+	int i;
+
+	// Split the value into 32-bit digits, least significant first.
+	for(i = 0; i < 4; i++) {
+		digits[i] = (u32)(value >> (32 * i));
+	}
+}
+
+static u128 from_digits(const u32* digits) {
+	u128 value = 0;
+	int i;
+
+	for(i = 3; i >= 0; i--) {
+		value = (value << 32) | digits[i];
+	}
+
+	return value;
+}
+
+static void multiply_digits(u32* product, u128 a, u128 b) {
+	u32 x[4];
+	u32 y[4];
+	u64 carry;
+	u64 t;
+	int i;
+	int j;
+
+	// Schoolbook multiplication into eight digits. The kernel has no
+	// 128-bit multiply with overflow, and the full product is needed to
+	// scale decimals anyway.
+	to_digits(x, a);
+	to_digits(y, b);
+	memset(product, 0, 8 * sizeof(u32));
+	for(i = 0; i < 4; i++) {
+		carry = 0;
+		for(j = 0; j < 4; j++) {
+			t = (u64)x[i] * y[j] + product[i + j] + carry;
+			product[i + j] = (u32)t;
+			carry = t >> 32;
+		}
+		product[i + 4] = (u32)carry;
+	}
+}
+
+static void divide_digits(u32* quotient, u32* remainder, const u32* dividend, int m, const u32* divisor, int n) {
+	const u64 base = 1ULL << 32;
+	u32 un[9];
+	u32 vn[4];
+	u64 qhat;
+	u64 rhat;
+	u64 p;
+	u64 k;
+	s64 t;
+	int shift;
+	int i;
+	int j;
+
+	// Knuth's algorithm D, as in Hacker's Delight, on 32-bit digits so every
+	// step fits a 64-bit operation. The kernel has no 128-bit division. The
+	// top digit of the divisor is non-zero and m >= n.
+
+	// Short division by a single digit.
+	if(n == 1) {
+		k = 0;
+		for(j = m - 1; j >= 0; j--) {
+			p = k * base + dividend[j];
+			quotient[j] = (u32)(p / divisor[0]);
+			k = p - (u64)quotient[j] * divisor[0];
+		}
+		remainder[0] = (u32)k;
+		return;
+	}
+
+	// Normalize so the divisor's top bit is set, which keeps each quotient
+	// digit estimate at most two too large.
+	shift = 32 - fls(divisor[n - 1]);
+	for(i = n - 1; i > 0; i--) {
+		vn[i] = (divisor[i] << shift) | (u32)((u64)divisor[i - 1] >> (32 - shift));
+	}
+	vn[0] = divisor[0] << shift;
+	un[m] = (u32)((u64)dividend[m - 1] >> (32 - shift));
+	for(i = m - 1; i > 0; i--) {
+		un[i] = (dividend[i] << shift) | (u32)((u64)dividend[i - 1] >> (32 - shift));
+	}
+	un[0] = dividend[0] << shift;
+
+	for(j = m - n; j >= 0; j--) {
+		// Estimate the quotient digit from the top two digits, and correct
+		// it with the third.
+		qhat = ((u64)un[j + n] * base + un[j + n - 1]) / vn[n - 1];
+		rhat = ((u64)un[j + n] * base + un[j + n - 1]) - qhat * vn[n - 1];
+		while(qhat >= base || qhat * vn[n - 2] > base * rhat + un[j + n - 2]) {
+			qhat--;
+			rhat += vn[n - 1];
+			if(rhat >= base) {
+				break;
+			}
+		}
+
+		// Multiply and subtract.
+		k = 0;
+		for(i = 0; i < n; i++) {
+			p = qhat * vn[i];
+			t = (s64)un[i + j] - (s64)k - (s64)(p & 0xffffffff);
+			un[i + j] = (u32)t;
+			k = (p >> 32) - (t >> 32);
+		}
+		t = (s64)un[j + n] - (s64)k;
+		un[j + n] = (u32)t;
+
+		// If the estimate was one too large, add the divisor back.
+		quotient[j] = (u32)qhat;
+		if(t < 0) {
+			quotient[j]--;
+			k = 0;
+			for(i = 0; i < n; i++) {
+				p = (u64)un[i + j] + vn[i] + k;
+				un[i + j] = (u32)p;
+				k = p >> 32;
+			}
+			un[j + n] += (u32)k;
+		}
+	}
+
+	// Unnormalize the remainder.
+	for(i = 0; i < n; i++) {
+		remainder[i] = (un[i] >> shift) | (u32)((u64)un[i + 1] << (32 - shift));
+	}
+}
+
+static u128 divide_wide(u32* quotient, const u32* dividend, u128 divisor, int round) {
+	u32 q[8] = { 0 };
+	u32 r[4] = { 0 };
+	u32 v[4];
+	u128 remainder;
+	int m = 8;
+	int n = 4;
+	int i;
+
+	// Divide the eight digit dividend by a non-zero divisor, returning the
+	// remainder. Both in 64 bits is the common case, and the CPU can do it.
+	to_digits(v, divisor);
+	while(m > 0 && !dividend[m - 1]) {
+		m--;
+	}
+	while(!v[n - 1]) {
+		n--;
+	}
+	if(m <= 2 && n <= 2) {
+		u64 a = (u64)dividend[1] << 32 | dividend[0];
+		u64 b = (u64)divisor;
+
+		to_digits(q, a / b);
+		remainder = a % b;
+	} else if(m < n) {
+		remainder = from_digits(dividend);
+	} else {
+		divide_digits(q, r, dividend, m, v, n);
+		remainder = from_digits(r);
+	}
+
+	// Round to nearest, ties to even. The remainder is below a divisor of
+	// at most 2^127, so doubling it cannot overflow.
+	if(round && (remainder * 2 > divisor || (remainder * 2 == divisor && (q[0] & 1)))) {
+		for(i = 0; i < 8; i++) {
+			if(++q[i]) {
+				break;
+			}
+		}
+	}
+
+	memcpy(quotient, q, sizeof(q));
+
+	return remainder;
+}
+
+static int to_signed(const u32* magnitude, int negative, s128* resultp) {
+	u128 value;
+
+	// Fail if the magnitude does not fit a signed 128-bit integer. The
+	// negative range reaches one further.
+	if(magnitude[4] | magnitude[5] | magnitude[6] | magnitude[7]) {
+		return RPNCALC_E_OVERFLOW;
+	}
+	value = from_digits(magnitude);
+	if(value > ((u128)1 << 127) - !negative) {
+		return RPNCALC_E_OVERFLOW;
+	}
+
+	*resultp = negative ? (s128)(0 - value) : (s128)value;
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static int integer_multiply(s128 a, s128 b, u128 scale, s128* resultp) {
+	u32 product[8];
+	u128 x = a < 0 ? 0 - (u128)a : (u128)a;
+	u128 y = b < 0 ? 0 - (u128)b : (u128)b;
+
+	// Multiply the magnitudes, and take decimals back to scale.
+	multiply_digits(product, x, y);
+	if(scale != 1) {
+		divide_wide(product, product, scale, 1);
+	}
+
+	return to_signed(product, (a < 0) != (b < 0), resultp);
+}
+
+static int integer_divide(s128 a, s128 b, u128 scale, s128* resultp) {
+	u32 dividend[8];
+	u32 quotient[8];
+	u128 x = a < 0 ? 0 - (u128)a : (u128)a;
+	u128 y = b < 0 ? 0 - (u128)b : (u128)b;
+
+	if(!y) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Scale a decimal dividend up first so the quotient keeps its
+	// fractional digits.
+	multiply_digits(dividend, x, scale);
+	divide_wide(quotient, dividend, y, 1);
+
+	return to_signed(quotient, (a < 0) != (b < 0), resultp);
+}
+
+static int integer_remainder(s128 a, s128 b, s128* resultp) {
+	u32 dividend[8];
+	u32 quotient[8];
+	u128 x = a < 0 ? 0 - (u128)a : (u128)a;
+	u128 y = b < 0 ? 0 - (u128)b : (u128)b;
+	u128 remainder;
+
+	if(!y) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Decimals share a scale, so their remainder is the remainder of the
+	// raw values.
+	multiply_digits(dividend, x, 1);
+	remainder = divide_wide(quotient, dividend, y, 0);
+	*resultp = a < 0 ? -(s128)remainder : (s128)remainder;
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static int lock_stack(struct rpncalc* calc) {
+	int retval;
+
+	// Only plain stacks keep values. The other kinds fold pushed values
+	// in, and the stack operators must not see their empty stack.
+	if(calc->kind != KIND_STACK) {
+		put_rpncalc(calc);
+		return RPNCALC_E_INVALID;
+	}
+
+	// Lock the calculator and note the access, so it is not compressed.
+	mutex_lock(&calc->lock);
+	calc->touched = jiffies;
+
+	// Unpack the stack if it was compressed while idle.
+	retval = unpack(calc);
+	if(retval != RPNCALC_E_SUCCESS) {
+		unlock_rpncalc(calc);
+		return retval;
+	}
+
+	// Move the stack closer if another node keeps using it.
+	if(migrate_accesses) {
+		follow_node(calc);
+	}
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static void put_bits(u64* words, size_t* bitp, u64 value, int count) {
+	size_t bit = *bitp;
+	int used = bit % 64;
+
+	// Append the low count bits of value, most significant first, to a
+	// zeroed buffer.
+	if(count < 64) {
+		value &= (1ULL << count) - 1;
+	}
+	if(used + count <= 64) {
+		words[bit / 64] |= count ? value << (64 - used - count) : 0;
+	} else {
+		words[bit / 64] |= value >> (used + count - 64);
+		words[bit / 64 + 1] |= value << (128 - used - count);
+	}
+	*bitp = bit + count;
+}
+
+static u64 get_bits(const u64* words, size_t* bitp, int count) {
+	size_t bit = *bitp;
+	int used = bit % 64;
+	u64 value;
+
+	// Read the next count bits, most significant first.
+	if(!count) {
+		return 0;
+	}
+	value = words[bit / 64] << used;
+	if(used + count > 64) {
+		value |= words[bit / 64 + 1] >> (64 - used);
+	}
+	*bitp = bit + count;
+
+	return value >> (64 - count);
+}
+
+static size_t encode_words(u64* packed, const u64* words, size_t count, int stride) {
+	size_t bit = 0;
+	u64 x;
+	int lead;
+	int trail;
+	int prev_lead = -1;
+	int prev_trail = 0;
+	size_t i;
+
+	// Gorilla encoding: XOR each word with the one stride words back, so
+	// the same part of the previous value. Slowly varying values share
+	// their sign, exponent and top of the mantissa, so the XOR is mostly
+	// zeros. With packed NULL, only count the bits.
+	for(i = 0; i < count; i++) {
+		if(i < stride) {
+			if(packed) {
+				put_bits(packed, &bit, words[i], 64);
+			} else {
+				bit += 64;
+			}
+			continue;
+		}
+
+		// A repeated word is a single zero bit.
+		x = words[i] ^ words[i - stride];
+		if(!x) {
+			bit += 1;
+			continue;
+		}
+
+		// If the changed bits fit within the previous window, write 10 and
+		// just those bits. Otherwise write 11, the leading zeros, the length
+		// and the bits, and make this the window.
+		lead = min(64 - fls64(x), 31);
+		trail = __ffs64(x);
+		if(prev_lead >= 0 && lead >= prev_lead && trail >= prev_trail) {
+			if(packed) {
+				put_bits(packed, &bit, 2, 2);
+				put_bits(packed, &bit, x >> prev_trail, 64 - prev_lead - prev_trail);
+			} else {
+				bit += 2 + 64 - prev_lead - prev_trail;
+			}
+		} else {
+			if(packed) {
+				put_bits(packed, &bit, 3, 2);
+				put_bits(packed, &bit, lead, 5);
+				put_bits(packed, &bit, 63 - lead - trail, 6);
+				put_bits(packed, &bit, x >> trail, 64 - lead - trail);
+			} else {
+				bit += 2 + 5 + 6 + 64 - lead - trail;
+			}
+			prev_lead = lead;
+			prev_trail = trail;
+		}
+	}
+
+	return bit;
+}
+
+static void decode_words(u64* words, const u64* packed, size_t count, int stride) {
+	size_t bit = 0;
+	int lead = 0;
+	int trail = 0;
+	size_t i;
+
+	// Reverse encode_words.
+	for(i = 0; i < count; i++) {
+		if(i < stride) {
+			words[i] = get_bits(packed, &bit, 64);
+		} else if(!get_bits(packed, &bit, 1)) {
+			words[i] = words[i - stride];
+		} else {
+			if(get_bits(packed, &bit, 1)) {
+				lead = get_bits(packed, &bit, 5);
+				trail = 63 - lead - get_bits(packed, &bit, 6);
+			}
+			words[i] = words[i - stride] ^ (get_bits(packed, &bit, 64 - lead - trail) << trail);
+		}
+	}
+}
+
+static void follow_node(struct rpncalc* calc) {
+	int node = numa_node_id();
+	int capacity = calc->capacity;
+	int huge;
+	void* data;
+
+	// Only count accesses in a row from the same remote node, so a stack
+	// shared between sockets does not bounce back and forth.
+	if(node == calc->node) {
+		calc->remote_hits = 0;
+		return;
+	}
+	if(node != calc->remote_node) {
+		calc->remote_node = node;
+		calc->remote_hits = 0;
+	}
+	if(++calc->remote_hits < migrate_accesses) {
+		return;
+	}
+	calc->remote_hits = 0;
+
+	// Copy the stack to the new node. An empty stack only needs to
+	// remember where to grow. Staying put is fine if memory there is short.
+	calc->node = node;
+	if(!calc->data) {
+		return;
+	}
+	data = alloc_stack(calc, &capacity, &huge);
+	if(!data) {
+		return;
+	}
+	memcpy(data, calc->data, (size_t)calc->size * calc->ops->width);
+	set_stack(calc, data, capacity, huge);
+}
+
+static void pack(struct rpncalc* calc) {
+	size_t count = ((size_t)calc->size * calc->ops->width + 7) / 8;
+	int stride = max(calc->ops->width / 8, 1);
+	size_t bits;
+	u64* packed;
+
+	// Try again after another quiet period, whatever happens.
+	calc->touched = jiffies;
+
+	// Narrow values are encoded in whole words, so make sure the buffer
+	// covers the last one.
+	if(count * 8 > (size_t)calc->capacity * calc->ops->width && reserve(calc, 1) != RPNCALC_E_SUCCESS) {
+		return;
+	}
+
+	// Measure first, and only compress if it saves at least half.
+	bits = encode_words(0, calc->data, count, stride);
+	if(bits > count * 32) {
+		return;
+	}
+	packed = kvzalloc_node((bits + 63) / 64 * sizeof(u64) + sizeof(u64), GFP_KERNEL, calc->node);
+	if(!packed) {
+		return;
+	}
+	encode_words(packed, calc->data, count, stride);
+
+	// Swap the stack for its compressed form.
+	free_stack(calc);
+	calc->packed = packed;
+}
+
+static int unpack(struct rpncalc* calc) {
+	size_t count = ((size_t)calc->size * calc->ops->width + 7) / 8;
+	int stride = max(calc->ops->width / 8, 1);
+	int capacity;
+	int huge;
+	void* data;
+
+	// Nothing to do if the stack is not compressed.
+	if(!calc->packed) {
+		return RPNCALC_E_SUCCESS;
+	}
+
+	// Decode into a stack with a little room to grow. Narrow values are
+	// decoded in whole words, so leave room for the last one.
+	capacity = max(calc->size + calc->size / 4 + 1, RPNCALC_MIN_CAPACITY);
+	data = alloc_stack(calc, &capacity, &huge);
+	if(!data) {
+		return RPNCALC_E_NOMEM;
+	}
+	decode_words(data, calc->packed, count, stride);
+
+	kvfree(calc->packed);
+	calc->packed = 0;
+	set_stack(calc, data, capacity, huge);
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static void compress_idle(struct work_struct* work) {
+	struct rpncalc* calc;
+	struct rpncalc* tmp;
+	unsigned long quiet = (unsigned long)idle_seconds * HZ;
+	LIST_HEAD(candidates);
+	int bkt;
+
+	// Hold the calculators that look unused for the quiet period, then let
+	// go of the table so compressing them does not hold up lookups.
+	if(quiet) {
+		mutex_lock(&calcs_lock);
+		hash_for_each(calcs, bkt, calc, next) {
+			if(time_after(jiffies, READ_ONCE(calc->touched) + quiet)) {
+				kref_get(&calc->ref);
+				list_add_tail(&calc->idle, &candidates);
+			}
+		}
+		mutex_unlock(&calcs_lock);
+	}
+
+	// Compress the ones still unused. Busy calculators are skipped rather
+	// than waited for.
+	list_for_each_entry_safe(calc, tmp, &candidates, idle) {
+		list_del(&calc->idle);
+		if(mutex_trylock(&calc->lock)) {
+			if(calc->data && calc->size && time_after(jiffies, calc->touched + quiet)) {
+				pack(calc);
+			}
+			mutex_unlock(&calc->lock);
+		}
+		put_rpncalc(calc);
+		cond_resched();
+	}
+
+	// Check again in half a quiet period, or a second if disabled.
+	schedule_delayed_work(&compress_work, max(quiet / 2, (unsigned long)HZ));
+}
+
+#include "rpncalc_number.h"
+
+static const char* skip_separators(const char* p, const char* end) {
+	u64 x;
+	u64 mask;
+
+	// Look for the first byte above ' ' eight at a time. Adding 0x5F sets
+	// the high bit of bytes from 0x21 up, and a carry out of a byte can only
+	// reach later bytes, so the lowest flagged byte is exact.
+	while(end - p >= 8) {
+		x = get_unaligned_le64(p);
+		mask = ((x + 0x5F5F5F5F5F5F5F5FULL) | x) & 0x8080808080808080ULL;
+		if(mask) {
+			return p + __ffs64(mask) / 8;
+		}
+		p += 8;
+	}
+	while(p < end && (u8)*p <= ' ') {
+		p++;
+	}
+
+	return p;
+}
+
+static const char* find_separator(const char* p, const char* end) {
+	u64 x;
+	u64 mask;
+
+	// Look for the first byte up to ' ' eight at a time, the classic test
+	// for a byte less than a constant. Borrows only reach later bytes.
+	while(end - p >= 8) {
+		x = get_unaligned_le64(p);
+		mask = (x - 0x2121212121212121ULL) & ~x & 0x8080808080808080ULL;
+		if(mask) {
+			return p + __ffs64(mask) / 8;
+		}
+		p += 8;
+	}
+	while(p < end && (u8)*p > ' ') {
+		p++;
+	}
+
+	return p;
+}
+
+static int encode_xor(u8* out, u64 x, int width) {
+	int lead;
+	int trail;
+	int n;
+	int i;
+
+	// A repeated value is a single byte.
+	if(!x) {
+		out[0] = width << 4;
+		return 1;
+	}
+
+	// Write the counts of zero bytes at either end, then the bytes between,
+	// low first.
+	lead = (64 - fls64(x)) / 8 - (8 - width);
+	trail = __ffs64(x) / 8;
+	n = width - lead - trail;
+	out[0] = lead << 4 | trail;
+	x >>= 8 * trail;
+	for(i = 1; i <= n; i++) {
+		out[i] = x;
+		x >>= 8;
+	}
+
+	return n + 1;
+}
+
+static int decode_xor(u64* xp, const u8* in, int len, int width) {
+	u64 x = 0;
+	int trail;
+	int n;
+	int i;
+
+	// Reverse encode_xor, returning 0 if the bytes run out.
+	if(len < 1) {
+		return 0;
+	}
+	trail = in[0] & 15;
+	n = width - (in[0] >> 4) - trail;
+	if(n < 0) {
+		return RPNCALC_E_INVALID;
+	}
+	if(len < n + 1) {
+		return 0;
+	}
+	for(i = 0; i < n; i++) {
+		x |= (u64)in[i + 1] << (8 * (trail + i));
+	}
+	*xp = x;
+
+	return n + 1;
+}
+
+static int encode_value(u8* out, const struct rpncalc_ops* ops, const void* data, int index) {
+	const s128* integers = data;
+	const u64* words = data;
+	const u32* floats = data;
+	u128 delta;
+	int n = 0;
+
+	switch(ops->type) {
+		case TYPE_INT128:
+		case TYPE_DECIMAL:
+		{
+			// Zigzag the difference from the value below, so the sign is the
+			// low bit, then write it seven bits at a time, low first.
+			delta = (u128)integers[index] - (index ? (u128)integers[index - 1] : 0);
+			delta = delta << 1 ^ (u128)((s128)delta >> 127);
+			while(delta >= 0x80) {
+				out[n++] = (u8)delta | 0x80;
+				delta >>= 7;
+			}
+			out[n++] = delta;
+			return n;
+		}
+		case TYPE_COMPLEX:
+		{
+			// Each part against the same part of the value below.
+			n = encode_xor(out, words[2 * index] ^ (index ? words[2 * index - 2] : 0), 8);
+			return n + encode_xor(out + n, words[2 * index + 1] ^ (index ? words[2 * index - 1] : 0), 8);
+		}
+		case TYPE_FLOAT:
+		{
+			return encode_xor(out, floats[index] ^ (index ? floats[index - 1] : 0), 4);
+		}
+		default:
+		{
+			return encode_xor(out, words[index] ^ (index ? words[index - 1] : 0), 8);
+		}
+	}
+}
+
+static int decode_value(void* data, int index, const struct rpncalc_ops* ops, const u8* in, int len) {
+	s128* integers = data;
+	u64* words = data;
+	u32* floats = data;
+	u128 delta = 0;
+	u64 re;
+	u64 im;
+	int n;
+	int i;
+
+	// Reverse encode_value, returning 0 if the bytes run out.
+	switch(ops->type) {
+		case TYPE_INT128:
+		case TYPE_DECIMAL:
+		{
+			for(i = 0; i < len; i++) {
+				delta |= (u128)(in[i] & 0x7f) << (7 * i);
+				if(in[i] < 0x80) {
+					delta = delta >> 1 ^ -(delta & 1);
+					integers[index] = (index ? (u128)integers[index - 1] : 0) + delta;
+					return i + 1;
+				}
+				if(i == RPNCALC_PACKED_MAX - 1) {
+					return RPNCALC_E_INVALID;
+				}
+			}
+			return 0;
+		}
+		case TYPE_COMPLEX:
+		{
+			n = decode_xor(&re, in, len, 8);
+			if(n <= 0) {
+				return n;
+			}
+			i = decode_xor(&im, in + n, len - n, 8);
+			if(i <= 0) {
+				return i;
+			}
+			words[2 * index] = re ^ (index ? words[2 * index - 2] : 0);
+			words[2 * index + 1] = im ^ (index ? words[2 * index - 1] : 0);
+			return n + i;
+		}
+		case TYPE_FLOAT:
+		{
+			n = decode_xor(&re, in, len, 4);
+			if(n > 0) {
+				floats[index] = re ^ (index ? floats[index - 1] : 0);
+			}
+			return n;
+		}
+		default:
+		{
+			n = decode_xor(&re, in, len, 8);
+			if(n > 0) {
+				words[index] = re ^ (index ? words[index - 1] : 0);
+			}
+			return n;
+		}
+	}
+}
+
+static void publish(struct rpncalc* calc, double value) {
+	struct rpncalc_subscriber* sub;
+
+	list_for_each_entry(sub, &calc->subscribers, next) {
+		sub->publish(sub, value);
+	}
+}
+
+static int start_log(struct rpncalc* calc) {
+
+	// Changes are only kept once someone asks for them.
+	if(calc->changes) {
+		return RPNCALC_E_SUCCESS;
+	}
+	calc->changes = kmalloc_array_node(RPNCALC_CHANGES, sizeof(struct rpncalc_change), GFP_KERNEL, calc->node);
+	if(!calc->changes) {
+		return RPNCALC_E_NOMEM;
+	}
+	calc->logged = calc->version;
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static void log_change(struct rpncalc* calc, int kind, int count, double value) {
+	struct rpncalc_change* change;
+
+	// Count the change, and record it if changes are kept.
+	calc->version++;
+	if(!calc->changes) {
+		return;
+	}
+	change = &calc->changes[calc->version % RPNCALC_CHANGES];
+	change->version = calc->version;
+	change->kind = kind;
+	change->count = count;
+	change->value = value;
+}
+
+static void log_rewrite(struct rpncalc* calc, int from, int old) {
+	int pops = old - from;
+	int index = from;
+	int replace = pops && calc->size > from;
+	int skip;
+
+	// Describe the values from index from up, of which there were old, as
+	// popped and pushed again, the first by replacing the top if possible.
+	if(pops - replace) {
+		log_change(calc, RPNCALC_CHANGE_POP, pops - replace, 0);
+	}
+	if(replace) {
+		log_change(calc, RPNCALC_CHANGE_REPLACE, 0, calc->changes ? calc->ops->get(calc->data, index) : 0);
+		index++;
+	}
+
+	// Only the last RPNCALC_CHANGES pushes can ever be read back, so just
+	// count the others.
+	skip = calc->size - index - RPNCALC_CHANGES;
+	if(skip > 0) {
+		calc->version += skip;
+		index += skip;
+	}
+	for(; index < calc->size; index++) {
+		log_change(calc, RPNCALC_CHANGE_PUSH, 0, calc->changes ? calc->ops->get(calc->data, index) : 0);
+	}
 }
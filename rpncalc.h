@@ -1,13 +1,80 @@
 #ifndef _RPNCALC_H_
 #define _RPNCALC_H_
 
+#include <linux/types.h>
+#include <linux/list.h>
+
 #define RPNCALC_E_SUCCESS (0)
 #define RPNCALC_E_NOMEM (-1)
 #define RPNCALC_E_INVALID (-2)
 #define RPNCALC_E_INSUFFICIENT (-3)
+#define RPNCALC_E_LIMIT (-4)
+#define RPNCALC_E_OVERFLOW (-5)
+
+#define RPNCALC_REGISTERS (16)		// Number of named registers per calculator.
+#define RPNCALC_NAME_MAX (16)		// Maximum name length, including terminator.
+
+#define RPNCALC_GLOBAL (-1)			// Handle used to define words for all calculators.
+#define RPNCALC_DEFAULT_BUDGET (1000000)	// Default instruction budget per program run.
+#define RPNCALC_DECIMAL_DIGITS (18)	// Fractional digits of decimal calculators.
+#define RPNCALC_FORMAT_MAX (32)		// Longest number written by rpncalc_format, with NUL.
+#define RPNCALC_PACKED_MAX (19)		// Longest value written by rpncalc_save, in bytes.
+#define RPNCALC_CHANGES (256)		// Changes kept per calculator, see rpncalc_changes.
+
+#define RPNCALC_CHANGE_PUSH (0)		// Push value.
+#define RPNCALC_CHANGE_POP (1)		// Pop count values.
+#define RPNCALC_CHANGE_REPLACE (2)	// Replace the top value with value.
+
+#define RPNCALC_STAT_COUNT (0)		// Number of values.
+#define RPNCALC_STAT_SUM (1)		// Sum of values.
+#define RPNCALC_STAT_MEAN (2)		// Arithmetic mean of values.
+#define RPNCALC_STAT_MIN (3)		// Smallest value.
+#define RPNCALC_STAT_MAX (4)		// Largest value.
+#define RPNCALC_STAT_VARIANCE (5)	// Population variance of values.
+#define RPNCALC_STAT_SAMPLE_VARIANCE (6)	// Sample variance of values.
+#define RPNCALC_STAT_EMA (7)		// Exponential moving average of values.
+#define RPNCALC_STAT_DISTINCT (8)	// Estimated number of distinct values.
+#define RPNCALC_STAT_HUGE_STACKS (9)	// Stacks backed by huge pages, for RPNCALC_GLOBAL.
+
+// Change to a calculator stack, see rpncalc_changes.
+struct rpncalc_change {
+	u64 version;					// Version the change led to.
+	int kind;						// One of RPNCALC_CHANGE_*.
+	int count;						// Number of values popped, for RPNCALC_CHANGE_POP.
+	double value;					// Value pushed or put on top.
+};
+
+// Receiver of the results of a calculator, see rpncalc_subscribe.
+struct rpncalc_subscriber {
+	void (*publish)(struct rpncalc_subscriber* sub, double value);	// Called with each result, under the calculator lock.
+	struct list_head next;			// Subscribers of the same calculator.
+	struct rpncalc* calc;			// Calculator subscribed to, or NULL.
+};
+
+void rpncalc_start(void);
+
+void rpncalc_stop(void);
 
 int	rpncalc_new(int* handlep);
 
+int rpncalc_new_window(int size, int* handlep);
+
+int rpncalc_new_accum(double alpha, int* handlep);
+
+int rpncalc_new_quantile(double accuracy, int* handlep);
+
+int rpncalc_new_distinct(int* handlep);
+
+int rpncalc_new_complex(int* handlep);
+
+int rpncalc_new_int128(int* handlep);
+
+int rpncalc_new_decimal(int* handlep);
+
+int rpncalc_new_float(int* handlep);
+
+int rpncalc_new_on_node(int node, int* handlep);
+
 int rpncalc_delete(int handle);
 
 int rpncalc_push(int handle, double value);
@@ -20,4 +87,88 @@ int rpncalc_size(int handle, int* sizep);
 
 int rpncalc_at(int handle, int index, double* valuep);
 
+int rpncalc_register(int handle, const char* name, int* slotp);
+
+int rpncalc_sto(int handle, int slot);
+
+int rpncalc_rcl(int handle, int slot, double* valuep);
+
+int rpncalc_define(int handle, const char* name, const char* body);
+
+int rpncalc_undefine(int handle, const char* name);
+
+int rpncalc_eval(int handle, const char* expr, double* valuep);
+
+int rpncalc_set_budget(int handle, long budget);
+
+int rpncalc_stat(int handle, int stat, double* valuep);
+
+int rpncalc_merge(int handle, int source);
+
+int rpncalc_quantile(int handle, double q, double* valuep);
+
+int rpncalc_sort(int handle, int count);
+
+int rpncalc_select(int handle, int count, int rank, double* valuep);
+
+int rpncalc_percentile(int handle, int count, double q, double* valuep);
+
+int rpncalc_median(int handle, int count, double* valuep);
+
+int rpncalc_topk(int handle, int count, int k);
+
+int rpncalc_cumsum(int handle, int count);
+
+int rpncalc_dot(int handle, int count, double* valuep);
+
+int rpncalc_horner(int handle, int count, double* valuep);
+
+int rpncalc_matmul(int handle, int rows, int inner, int cols);
+
+int rpncalc_transpose(int handle, int rows, int cols);
+
+int rpncalc_det(int handle, int n, double* valuep);
+
+int rpncalc_solve(int handle, int n, int cols);
+
+int rpncalc_push_complex(int handle, double re, double im);
+
+int rpncalc_pop_complex(int handle, double* rep, double* imp);
+
+int rpncalc_at_complex(int handle, int index, double* rep, double* imp);
+
+int rpncalc_cop(int handle, char op, double* rep, double* imp);
+
+int rpncalc_push_int(int handle, s128 value);
+
+int rpncalc_pop_int(int handle, s128* valuep);
+
+int rpncalc_at_int(int handle, int index, s128* valuep);
+
+int rpncalc_iop(int handle, char op, s128* valuep);
+
+int rpncalc_push_text(int handle, const char* text, int len, int* usedp);
+
+int rpncalc_format(double value, char* text);
+
+int rpncalc_print(int handle, int* indexp, char* text, int len, int* usedp);
+
+int rpncalc_push_packed(int handle, const void* data, int len, int* usedp);
+
+int rpncalc_save(int handle, int* indexp, void* data, int len, int* usedp);
+
+int rpncalc_pop_packed(int handle, int count, void* data, int len, int* usedp);
+
+int rpncalc_drop(int handle, int count);
+
+int rpncalc_push_raw(int handle, const void* data, int len, int* usedp);
+
+int rpncalc_subscribe(int handle, struct rpncalc_subscriber* sub);
+
+int rpncalc_unsubscribe(struct rpncalc_subscriber* sub);
+
+int rpncalc_version(int handle, u64* versionp);
+
+int rpncalc_changes(int handle, u64 since, struct rpncalc_change* changes, int max, int* countp);
+
 #endif // _RPNCALC_H_
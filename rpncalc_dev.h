@@ -0,0 +1,165 @@
+#ifndef _RPNCALC_DEV_H_
+#define _RPNCALC_DEV_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ *	Interface of the /dev/rpncalc character device. Each open of the device
+ *	gets its own double calculator, deleted when the file is closed.
+ *
+ *	write - Push decimal numbers separated by spaces or newlines. A number
+ *		split across writes is pushed once the rest arrives. A bad number
+ *		ends the write early, after the numbers before it, or fails it with
+ *		EINVAL if it is the first; RPNCALC_IOC_ERROR gives its offset.
+ *
+ *	read - Read the stack from the bottom up, one number per line, each the
+ *		shortest decimal that reads back as the same double. Successive
+ *		reads continue where the last one stopped, and after the end of
+ *		the stack is reported the next read starts from the bottom again.
+ *		A read of zero bytes returns 0 and moves nothing. A buffer too
+ *		short for the next line fails with EINVAL.
+ *
+ *	splice - Push values spliced from a pipe, in binary as the calculator
+ *		holds them: native doubles, floats, pairs of doubles for complex
+ *		numbers, or 128-bit integers for integer and decimal calculators.
+ *		A value split across pipe buffers is pushed once the rest arrives.
+ *		Data written with vmsplice() reaches the stack in one copy.
+ *
+ *	poll - Besides always being writable, the file is readable when results
+ *		were published to its ring since poll last said so. Subscribers
+ *		read the ring with plain loads and only poll once they catch up.
+ *
+ *	mmap - Map the result ring read-only, from offset 0, once
+ *		RPNCALC_IOC_SUBSCRIBE has made it.
+ *
+ *	Text only works with double and float calculators. The ioctls below
+ *	move values of any type in the packed encoding of rpncalc_save, which
+ *	for slowly changing values takes a fraction of their size.
+ */
+
+#define RPNCALC_NUMBER_MAX (128)	// Longest number that can be split across writes.
+#define RPNCALC_BUFFER_MAX (1 << 26)	// Largest registered buffer, in bytes.
+#define RPNCALC_RING_MAX (1 << 20)	// Most slots in a result ring.
+
+#define RPNCALC_IOC_MAGIC ('r')
+
+// Types of calculator for RPNCALC_IOC_NEW.
+#define RPNCALC_DEV_DOUBLE (0)		// Doubles, the type a new file starts with.
+#define RPNCALC_DEV_FLOAT (1)		// Single precision floats.
+#define RPNCALC_DEV_COMPLEX (2)		// Complex numbers as pairs of doubles.
+#define RPNCALC_DEV_INT128 (3)		// 128-bit integers.
+#define RPNCALC_DEV_DECIMAL (4)		// 128-bit fixed point decimals.
+
+// Buffer of packed values.
+struct rpncalc_packed {
+	__u64 data;						// User address of the buffer.
+	__u32 len;						// Size of the buffer in bytes.
+	__u32 used;						// Returns the number of bytes pushed or written.
+	__u32 count;					// Number of values to pop, for RPNCALC_IOC_POP.
+	__u32 index;					// Stack position to save from, advanced past the
+									// values saved, for RPNCALC_IOC_SAVE.
+};
+
+// User buffer for RPNCALC_IOC_REGISTER.
+struct rpncalc_buffer {
+	__u64 addr;						// User address of the buffer, or 0 for none.
+	__u64 len;						// Size of the buffer in bytes.
+};
+
+// Subscription for RPNCALC_IOC_SUBSCRIBE.
+struct rpncalc_subscription {
+	__s32 fd;						// Open, readable calculator file to receive results
+									// of, or -1 for none.
+	__u32 slots;					// Size of the ring, a power of two, when it is made.
+};
+
+// Result in the ring.
+struct rpncalc_result {
+	__u64 seq;						// Number of the result plus one, or 0 while written.
+	__u64 value;					// Bits of the result as a double.
+};
+
+// Ring of results, written only by the kernel. Result n goes in slot
+// n % slots, replacing the one slots results before it. To read result n,
+// load its seq with acquire ordering. Less than n + 1 means it is not
+// written yet, more means it has been replaced, so skip ahead to
+// head - slots. Otherwise load value, then seq again after a read barrier.
+// If seq changed, the result was replaced while being read. Any number of
+// readers can follow the ring this way without writing to it.
+struct rpncalc_ring {
+	__u64 head;						// Number of results published, stored with release.
+	__u32 slots;					// Number of slots.
+	__u32 reserved[13];				// Keeps results off the cache line of head.
+	struct rpncalc_result results[];	// Slots.
+};
+
+// Kinds of change in struct rpncalc_delta.
+#define RPNCALC_DELTA_PUSH (0)		// Push value.
+#define RPNCALC_DELTA_POP (1)		// Pop count values.
+#define RPNCALC_DELTA_REPLACE (2)	// Replace the top value with value.
+
+// Change to the stack.
+struct rpncalc_delta {
+	__u64 version;					// Version the change led to.
+	__u32 kind;						// One of RPNCALC_DELTA_*.
+	__u32 count;					// Number of values popped, for RPNCALC_DELTA_POP.
+	__u64 value;					// Bits of the double pushed or put on top.
+};
+
+// Request for RPNCALC_IOC_CHANGES.
+struct rpncalc_log {
+	__u64 since;					// Version to read the changes after.
+	__u64 data;						// User address of an array of struct rpncalc_delta.
+	__u32 max;						// Length of the array.
+	__u32 count;					// Returns the number of changes.
+	__u64 version;					// Returns the version of the stack.
+};
+
+// Read the offset in the written text of the last bad number, or -1.
+#define RPNCALC_IOC_ERROR _IOR(RPNCALC_IOC_MAGIC, 1, __s64)
+
+// Replace the calculator with an empty one of a type above.
+#define RPNCALC_IOC_NEW _IOW(RPNCALC_IOC_MAGIC, 2, __u32)
+
+// Push packed values. A value cut off by the end of the buffer is not
+// pushed, so resubmit from used. A bad value fails with EINVAL, after the
+// values before it.
+#define RPNCALC_IOC_PUSH _IOWR(RPNCALC_IOC_MAGIC, 3, struct rpncalc_packed)
+
+// Pop count values, packed bottom first. Fails with ENOSPC, popping
+// nothing, if they do not fit in the buffer.
+#define RPNCALC_IOC_POP _IOWR(RPNCALC_IOC_MAGIC, 4, struct rpncalc_packed)
+
+// Write as many values from index up as fit, packed, leaving the stack as
+// it is. Pushing the pieces of a stack saved from the bottom onto an empty
+// calculator restores it.
+#define RPNCALC_IOC_SAVE _IOWR(RPNCALC_IOC_MAGIC, 5, struct rpncalc_packed)
+
+// Register a buffer, replacing any registered before. Its pages stay pinned
+// and mapped in the kernel, counted against RLIMIT_MEMLOCK, until another
+// buffer is registered or the file is closed. A push, pop or save whose
+// buffer lies wholly inside it is done in place, in one pass over the stack
+// with no copy. The same calls on other buffers still work, through a copy,
+// as do all calls from processes other than the one that registered it,
+// such as a child after fork. The pinned pages are the ones mapped when it
+// was registered, so register again after remapping the range.
+#define RPNCALC_IOC_REGISTER _IOW(RPNCALC_IOC_MAGIC, 6, struct rpncalc_buffer)
+
+// Publish the value left by each operation or expression on the calculator
+// of another open file, or this one, to this file's ring, replacing any
+// subscription before. The subscription ends when that file replaces its
+// calculator or is closed. The first subscription makes the ring, with the
+// given number of slots, and later ones keep it, along with its count of
+// results.
+#define RPNCALC_IOC_SUBSCRIBE _IOW(RPNCALC_IOC_MAGIC, 7, struct rpncalc_subscription)
+
+// Read up to max changes to the stack after version since, and the
+// version the stack is at, so a mirror can catch up with what changed. A
+// mirror takes a snapshot with read or RPNCALC_IOC_SAVE between two of
+// these with max 0, retrying if the version moved. Only the latest
+// changes are kept, and ESTALE means some after since are gone, so the
+// mirror takes a new snapshot.
+#define RPNCALC_IOC_CHANGES _IOWR(RPNCALC_IOC_MAGIC, 8, struct rpncalc_log)
+
+#endif // _RPNCALC_DEV_H_
@@ -0,0 +1,175 @@
+/*
+ *	Bulk arithmetic kernels of rpncalc.c. The file is included once per
+ *	instruction set, with KERNEL(name) defined to give each copy its own
+ *	names and KERNEL_TARGET to the target attribute saying which
+ *	instructions it may use, and select_kernels() picks the best copy the
+ *	CPU supports when the module loads. Keep the loops plain so each copy
+ *	vectorizes to its own width. Callers run the kernels between
+ *	vector_begin() and vector_end(), so nothing here may sleep.
+ */
+
+static void KERNEL_TARGET KERNEL(prefix_sum)(double* values, int count, double carry) {
+	double a, b, c, d;
+	int i;
+
+	// Sum blocks of four on their own and add the running total after, so
+	// only one addition per block waits on the previous block. The total
+	// starts at @carry, the sum of the values before these.
+	for(i = 0; i + 4 <= count; i += 4) {
+		a = values[i];
+		b = a + values[i + 1];
+		c = b + values[i + 2];
+		d = c + values[i + 3];
+		values[i] = carry + a;
+		values[i + 1] = carry + b;
+		values[i + 2] = carry + c;
+		values[i + 3] = carry + d;
+		carry += d;
+	}
+
+	// Finish the values left over.
+	for(; i < count; i++) {
+		carry += values[i];
+		values[i] = carry;
+	}
+}
+
+static double KERNEL_TARGET KERNEL(dot_product)(const double* x, const double* y, int count) {
+	double sum[4] = { 0, 0, 0, 0 };
+	int i;
+
+	// Keep four independent sums so the multiplies and adds pipeline, and
+	// the compiler can vectorize the loop.
+	for(i = 0; i + 4 <= count; i += 4) {
+		sum[0] += x[i] * y[i];
+		sum[1] += x[i + 1] * y[i + 1];
+		sum[2] += x[i + 2] * y[i + 2];
+		sum[3] += x[i + 3] * y[i + 3];
+	}
+
+	// Finish the values left over.
+	for(; i < count; i++) {
+		sum[0] += x[i] * y[i];
+	}
+
+	return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+static double KERNEL_TARGET KERNEL(polynomial)(const double* coefficients, int count, double x, double carry) {
+	double lanes[4] = { 0, 0, 0, 0 };
+	double power = x * x;
+	double size = x < 0 ? -x : x;
+	int first;
+	int i = 0;
+	int j;
+
+	// x to the fourth overflows once |x| is above about 1e77, and underflows
+	// once it is tiny, where Horner's rule is still right. Keep to Horner's
+	// rule unless x to the fourth stays well inside the range of a double.
+	if(!(size <= 0x1p128) || (size < 0x1p-128 && x != 0)) {
+		for(; i < count; i++) {
+			carry = carry * x + coefficients[i];
+		}
+		return carry;
+	}
+
+	// Plain Horner's rule is one long chain of dependent multiply-adds.
+	// Evaluate the powers of each residue mod 4 as four polynomials in x to
+	// the fourth instead, one per lane of a vector, then combine them.
+	// @carry is the value of the coefficients before these, so it goes in
+	// one degree above the first, and the lanes below it stay empty.
+	power *= power;
+	first = (4 - (count + 1) % 4) % 4;
+	j = first;
+	lanes[j++] = carry;
+	while(j < 4 && i < count) {
+		lanes[j++] = coefficients[i++];
+	}
+
+	// The next block seeds the empty lanes rather than scaling them.
+	if(i < count) {
+		for(j = 0; j < 4; j++) {
+			lanes[j] = j < first ? coefficients[i + j] : lanes[j] * power + coefficients[i + j];
+		}
+		i += 4;
+	}
+	for(; i < count; i += 4) {
+		for(j = 0; j < 4; j++) {
+			lanes[j] = lanes[j] * power + coefficients[i + j];
+		}
+	}
+
+	return ((lanes[0] * x + lanes[1]) * x + lanes[2]) * x + lanes[3];
+}
+
+static void KERNEL_TARGET KERNEL(matrix_tile)(const double* a, const double* b, double* c, int rows, int inner, int cols, int astride, int stride) {
+	const double* brow;
+	double* crow;
+	double scale;
+	int i, k, j;
+
+	// Scale a row of b by one value of a and add it to a row of c, which
+	// is a contiguous loop the compiler can vectorize. Rows of a are
+	// @astride values apart and rows of b and c @stride.
+	for(i = 0; i < rows; i++) {
+		crow = c + (size_t)i * stride;
+		for(k = 0; k < inner; k++) {
+			scale = a[(size_t)i * astride + k];
+			brow = b + (size_t)k * stride;
+			for(j = 0; j < cols; j++) {
+				crow[j] += scale * brow[j];
+			}
+		}
+	}
+}
+
+static void KERNEL_TARGET KERNEL(prefix_sum_float)(float* values, int count, float carry) {
+	float sums[8];
+	int i;
+	int j;
+
+	// Sum blocks of eight, one vector of floats, on their own and add the
+	// running total after, as prefix_sum does for doubles.
+	for(i = 0; i + 8 <= count; i += 8) {
+		sums[0] = values[i];
+		for(j = 1; j < 8; j++) {
+			sums[j] = sums[j - 1] + values[i + j];
+		}
+		for(j = 0; j < 8; j++) {
+			values[i + j] = carry + sums[j];
+		}
+		carry += sums[7];
+	}
+
+	// Finish the values left over.
+	for(; i < count; i++) {
+		carry += values[i];
+		values[i] = carry;
+	}
+}
+
+static float KERNEL_TARGET KERNEL(dot_product_float)(const float* x, const float* y, int count) {
+	float sum[16] = { 0 };
+	float total = 0;
+	int i;
+	int j;
+
+	// Keep sixteen independent sums, so a vectorized loop has a full
+	// vector of floats in flight per pair of accumulators.
+	for(i = 0; i + 16 <= count; i += 16) {
+		for(j = 0; j < 16; j++) {
+			sum[j] += x[i + j] * y[i + j];
+		}
+	}
+
+	// Finish the values left over.
+	for(; i < count; i++) {
+		sum[0] += x[i] * y[i];
+	}
+
+	for(j = 0; j < 16; j++) {
+		total += sum[j];
+	}
+
+	return total;
+}
@@ -0,0 +1,532 @@
+/*
+ *	Conversions between decimal and double of rpncalc.c: parse_number() and
+ *	the helpers it rounds with, and shortest(), which finds the digits
+ *	rpncalc_format writes. Included into rpncalc.c, which declares these
+ *	functions, and into tools/number_test.c, which checks them against the
+ *	C library in user space.
+ */
+
+#define RPNCALC_EXACT_DIGITS (768)		// Digits that can decide how a number rounds.
+#define RPNCALC_BIG_LIMBS (128)			// 32-bit limbs of numbers used to round them.
+
+#include "rpncalc_pow5.h"
+
+static int eight_digits(const char* p) {
+	u64 x = get_unaligned_le64(p);
+
+	// Each byte must be 0x30 to 0x39: a high nibble of 3, and a low nibble
+	// that does not carry into the high one when six is added.
+	return !(((x & 0xF0F0F0F0F0F0F0F0ULL) | (((x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ^ 0x3333333333333333ULL);
+}
+
+static u32 parse_eight(const char* p) {
+	u64 x = get_unaligned_le64(p) - 0x3030303030303030ULL;
+
+	// Combine neighbouring digits into pairs, then pairs into fours, then
+	// the two fours, all in one word.
+	x = x * 10 + (x >> 8);
+	x = ((x & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)) +
+		((x >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32))) >> 32;
+
+	return x;
+}
+
+static void big_muladd(u32* big, int* lenp, u32 mul, u32 add) {
+	u64 carry = add;
+	int i;
+
+	// Multiply limb by limb, carrying into a new top limb if needed.
+	for(i = 0; i < *lenp; i++) {
+		carry += (u64)big[i] * mul;
+		big[i] = carry;
+		carry >>= 32;
+	}
+	if(carry) {
+		big[(*lenp)++] = carry;
+	}
+}
+
+static void big_pow5(u32* big, int* lenp, int n) {
+
+	// 5^13 is the largest power of five that fits in a limb.
+	for(; n >= 13; n -= 13) {
+		big_muladd(big, lenp, 1220703125, 0);
+	}
+	for(; n > 0; n--) {
+		big_muladd(big, lenp, 5, 0);
+	}
+}
+
+static void big_shift(u32* big, int* lenp, int bits) {
+	int limbs = bits / 32;
+	int i;
+
+	// Shift whole limbs first, then the bits left over.
+	bits %= 32;
+	if(bits) {
+		big[*lenp] = 0;
+		for(i = *lenp; i > 0; i--) {
+			big[i] = big[i] << bits | big[i - 1] >> (32 - bits);
+		}
+		big[0] <<= bits;
+		if(big[*lenp]) {
+			(*lenp)++;
+		}
+	}
+	if(limbs) {
+		memmove(big + limbs, big, *lenp * sizeof(u32));
+		memset(big, 0, limbs * sizeof(u32));
+		*lenp += limbs;
+	}
+}
+
+static int big_compare(const u32* a, int alen, const u32* b, int blen) {
+	int i;
+
+	// Neither has leading zero limbs, so the longer is larger.
+	if(alen != blen) {
+		return alen < blen ? -1 : 1;
+	}
+	for(i = alen - 1; i >= 0; i--) {
+		if(a[i] != b[i]) {
+			return a[i] < b[i] ? -1 : 1;
+		}
+	}
+
+	return 0;
+}
+
+static u64 eisel_lemire(u64 w, int q) {
+	u128 product;
+	u64 high;
+	u64 low;
+	u64 mantissa;
+	int lz;
+	int upper;
+	int power2;
+
+	// Exponents past the table give zero or infinity for any 19 digits.
+	if(q < RPNCALC_POW5_MIN) {
+		return 0;
+	}
+	if(q > RPNCALC_POW5_MAX) {
+		return 0x7FFULL << 52;
+	}
+
+	// Multiply the normalized mantissa by the power of five. The high half
+	// of the power is enough unless the bits below the 55 needed are all
+	// ones, in which case the low half may carry into them.
+	lz = 64 - fls64(w);
+	w <<= lz;
+	product = (u128)w * pow5[q - RPNCALC_POW5_MIN][0];
+	high = product >> 64;
+	low = product;
+	if((high & 0x1FF) == 0x1FF) {
+		product = (u128)w * pow5[q - RPNCALC_POW5_MIN][1];
+		low += (u64)(product >> 64);
+		if(low < (u64)(product >> 64)) {
+			high++;
+		}
+	}
+
+	// Take 54 bits, one more than a double holds, and work out the binary
+	// exponent. 217706 / 2^16 is log2(10) closely enough for the table.
+	upper = high >> 63;
+	mantissa = high >> (upper + 9);
+	power2 = ((217706 * q) >> 16) + 63 + upper - lz + 1023;
+
+	// Subnormal results are shifted down and rounded to the fixed exponent.
+	if(power2 <= 0) {
+		if(-power2 + 1 >= 64) {
+			return 0;
+		}
+		mantissa >>= -power2 + 1;
+		mantissa += mantissa & 1;
+		mantissa >>= 1;
+		return mantissa;
+	}
+
+	// A product can only be exactly halfway between two doubles for small
+	// exponents. Round those ties to even rather than up.
+	if(low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 && mantissa << (upper + 9) == high) {
+		mantissa &= ~1ULL;
+	}
+
+	// Round, carrying into the exponent if the mantissa overflows.
+	mantissa += mantissa & 1;
+	mantissa >>= 1;
+	if(mantissa >= (2ULL << 52)) {
+		mantissa = 1ULL << 52;
+		power2++;
+	}
+	if(power2 >= 0x7FF) {
+		return 0x7FFULL << 52;
+	}
+
+	return (mantissa & ~(1ULL << 52)) | (u64)power2 << 52;
+}
+
+static u64 round_digits(const char* p, const char* end, int explicit, u64 lower) {
+	static const u32 powers[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+	u32* left;
+	u32* right;
+	u64 mantissa;
+	u32 chunk = 0;
+	int nchunk = 0;
+	int ndigits = 0;
+	int fraction = 0;
+	int sticky = 0;
+	int exponent = explicit;
+	int exponent2;
+	int llen = 0;
+	int rlen = 0;
+	int cmp;
+
+	// The number is lower or the double after it. Without memory to work
+	// it out, lower is within an ulp.
+	left = kcalloc(2 * RPNCALC_BIG_LIMBS, sizeof(u32), GFP_KERNEL);
+	if(!left) {
+		return lower;
+	}
+	right = left + RPNCALC_BIG_LIMBS;
+
+	// Read the significant digits into a big integer, nine at a time, so
+	// the number is left * 10^exponent. Digits past RPNCALC_EXACT_DIGITS
+	// cannot change the result except by being non-zero, so they are kept
+	// as a trailing 1.
+	for(; p < end && *p != 'e' && *p != 'E'; p++) {
+		if(*p == '.') {
+			fraction = 1;
+		} else if(!ndigits && *p == '0') {
+			exponent -= fraction;
+		} else if(ndigits < RPNCALC_EXACT_DIGITS) {
+			chunk = chunk * 10 + (*p - '0');
+			ndigits++;
+			exponent -= fraction;
+			if(++nchunk == 9) {
+				big_muladd(left, &llen, powers[9], chunk);
+				chunk = 0;
+				nchunk = 0;
+			}
+		} else {
+			sticky |= *p != '0';
+			exponent += !fraction;
+		}
+	}
+	big_muladd(left, &llen, powers[nchunk], chunk);
+	if(sticky) {
+		big_muladd(left, &llen, 10, 1);
+		exponent--;
+	}
+
+	// The halfway point between lower and the next double is
+	// (2 * mantissa + 1) * 2^(exponent2 - 1).
+	mantissa = lower & ((1ULL << 52) - 1);
+	exponent2 = lower >> 52;
+	if(exponent2) {
+		mantissa |= 1ULL << 52;
+		exponent2 -= 1075;
+	} else {
+		exponent2 = -1074;
+	}
+	mantissa = 2 * mantissa + 1;
+	right[0] = mantissa;
+	right[1] = mantissa >> 32;
+	rlen = right[1] ? 2 : 1;
+
+	// Compare the two with both sides integers.
+	if(exponent >= 0) {
+		big_pow5(left, &llen, exponent);
+	} else {
+		big_pow5(right, &rlen, -exponent);
+	}
+	if(exponent - exponent2 + 1 >= 0) {
+		big_shift(left, &llen, exponent - exponent2 + 1);
+	} else {
+		big_shift(right, &rlen, exponent2 - 1 - exponent);
+	}
+	cmp = big_compare(left, llen, right, rlen);
+	kfree(left);
+
+	// Round up above halfway, and to even at it.
+	if(cmp > 0 || (cmp == 0 && (lower & 1))) {
+		return lower + 1;
+	}
+
+	return lower;
+}
+
+static int parse_number(const char* token, int len, double* valuep) {
+	// Powers of ten that are exactly representable as doubles.
+	static const double powers[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+	const char* end = token + len;
+	const char* p = token;
+	const char* start;
+	u64 mantissa = 0;
+	u64 bits;
+	int digits = 0;
+	int exponent = 0;
+	int explicit = 0;
+	int negative = 0;
+	int expnegative = 0;
+	int truncated = 0;
+	double value;
+
+	// Parse the sign.
+	if(p < end && (*p == '+' || *p == '-')) {
+		negative = (*p++ == '-');
+	}
+	start = p;
+
+	// Infinities and NaN read back as rpncalc_format writes them, in any
+	// case, as do the other spellings strtod accepts.
+	if((end - p == 3 && !strncasecmp(p, "inf", 3)) || (end - p == 8 && !strncasecmp(p, "infinity", 8)) ||
+			(end - p == 3 && !strncasecmp(p, "nan", 3))) {
+		bits = tolower(*p) == 'n' ? 0x7FF8ULL << 48 : 0x7FFULL << 52;
+		memcpy(&value, &bits, sizeof(value));
+		*valuep = negative ? -value : value;
+		return RPNCALC_E_SUCCESS;
+	}
+
+	// Parse the integer digits, keeping up to 19 significant digits. Take
+	// eight at a time while they fit.
+	while(end - p >= 8 && mantissa < 10000000000ULL && eight_digits(p)) {
+		mantissa = mantissa * 100000000 + parse_eight(p);
+		digits += 8;
+		p += 8;
+	}
+	for(; p < end && isdigit(*p); p++) {
+		if(mantissa < 1000000000000000000ULL) {
+			mantissa = mantissa * 10 + (*p - '0');
+		} else {
+			truncated |= *p != '0';
+			exponent++;
+		}
+		digits++;
+	}
+
+	// Parse the fraction digits.
+	if(p < end && *p == '.') {
+		p++;
+		while(end - p >= 8 && mantissa < 10000000000ULL && eight_digits(p)) {
+			mantissa = mantissa * 100000000 + parse_eight(p);
+			exponent -= 8;
+			digits += 8;
+			p += 8;
+		}
+		for(; p < end && isdigit(*p); p++) {
+			if(mantissa < 1000000000000000000ULL) {
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			} else {
+				truncated |= *p != '0';
+			}
+			digits++;
+		}
+	}
+
+	// There must be at least one digit.
+	if(!digits) {
+		return RPNCALC_E_INVALID;
+	}
+
+	// Parse the exponent.
+	if(p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		if(p < end && (*p == '+' || *p == '-')) {
+			expnegative = (*p++ == '-');
+		}
+		if(p == end || !isdigit(*p)) {
+			return RPNCALC_E_INVALID;
+		}
+		for(; p < end && isdigit(*p); p++) {
+			if(explicit < 100000) {
+				explicit = explicit * 10 + (*p - '0');
+			}
+		}
+		explicit = expnegative ? -explicit : explicit;
+		exponent += explicit;
+	}
+
+	// The whole token must be a number.
+	if(p != end) {
+		return RPNCALC_E_INVALID;
+	}
+
+	if(!mantissa) {
+		value = 0;
+	} else if(!truncated && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+
+		// When the mantissa and the power of ten are both exactly
+		// representable, one multiply or divide rounds correctly.
+		value = mantissa;
+		if(exponent > 0) {
+			value *= powers[exponent];
+		} else if(exponent < 0) {
+			value /= powers[-exponent];
+		}
+	} else {
+
+		// Otherwise round the product with a 128-bit power of five. A
+		// truncated mantissa lies between mantissa and mantissa + 1, so if
+		// both round the same way that is the answer. If not, the digits
+		// dropped decide.
+		bits = eisel_lemire(mantissa, exponent);
+		if(truncated && eisel_lemire(mantissa + 1, exponent) != bits) {
+			bits = round_digits(start, end, explicit, bits);
+		}
+		memcpy(&value, &bits, sizeof(value));
+	}
+
+	*valuep = negative ? -value : value;
+
+	return RPNCALC_E_SUCCESS;
+}
+
+static int pow5_bits(int e) {
+
+	// Bits in 5^e, from a fixed point log2(5).
+	return ((e * 1217359) >> 19) + 1;
+}
+
+static int pow5_factor(u64 value) {
+	int count = 0;
+
+	// Count the times five divides a non-zero value.
+	while(value % 5 == 0) {
+		value /= 5;
+		count++;
+	}
+
+	return count;
+}
+
+static u64 mul_shift(u64 m, const u64* mul, int j) {
+	u128 low = (u128)m * mul[0];
+	u128 high = (u128)m * mul[1];
+
+	// The 64 bits of m * mul >> j, where j is at least 64.
+	return ((low >> 64) + high) >> (j - 64);
+}
+
+static u64 shortest(u64 bits, int* exponentp) {
+	u64 fraction = bits & ((1ULL << 52) - 1);
+	int biased = (bits >> 52) & 0x7FF;
+	u64 m2;
+	u64 mv;
+	u64 vr;
+	u64 vp;
+	u64 vm;
+	int e2;
+	int e10;
+	int q;
+	int i;
+	int k;
+	int even;
+	int mm_shift;
+	int vm_zeros = 0;
+	int vr_zeros = 0;
+	int removed = 0;
+	int last = 0;
+	int round_up = 0;
+
+	// Ryu: the double is m2 * 2^e2, and any decimal in the interval from
+	// halfway to the double below to halfway to the double above reads back
+	// as it. Scale the midpoints, four times over so they are integers,
+	// by the power of ten that leaves about 17 digits.
+	if(biased) {
+		m2 = fraction | 1ULL << 52;
+		e2 = biased - 1023 - 52 - 2;
+	} else {
+		m2 = fraction;
+		e2 = 1 - 1023 - 52 - 2;
+	}
+	even = !(m2 & 1);
+	mv = 4 * m2;
+	mm_shift = fraction || biased <= 1;
+	if(e2 >= 0) {
+		q = ((e2 * 78913) >> 18) - (e2 > 3);
+		e10 = q;
+		k = RPNCALC_POW5_BITS + pow5_bits(q) - 1;
+		i = -e2 + q + k;
+		vr = mul_shift(mv, pow5_inv_split[q], i);
+		vp = mul_shift(mv + 2, pow5_inv_split[q], i);
+		vm = mul_shift(mv - 1 - mm_shift, pow5_inv_split[q], i);
+
+		// Small powers may divide the scaled values exactly, which the
+		// rounding below needs to know.
+		if(q <= 21) {
+			if(mv % 5 == 0) {
+				vr_zeros = pow5_factor(mv) >= q;
+			} else if(even) {
+				vm_zeros = pow5_factor(mv - 1 - mm_shift) >= q;
+			} else {
+				vp -= pow5_factor(mv + 2) >= q;
+			}
+		}
+	} else {
+		q = ((-e2 * 732923) >> 20) - (-e2 > 1);
+		e10 = q + e2;
+		i = -e2 - q;
+		k = pow5_bits(i) - RPNCALC_POW5_BITS;
+		vr = mul_shift(mv, pow5_split[i], q - k);
+		vp = mul_shift(mv + 2, pow5_split[i], q - k);
+		vm = mul_shift(mv - 1 - mm_shift, pow5_split[i], q - k);
+		if(q <= 1) {
+			vr_zeros = 1;
+			if(even) {
+				vm_zeros = mm_shift;
+			} else {
+				vp--;
+			}
+		} else if(q < 63) {
+			vr_zeros = !(mv & ((1ULL << q) - 1));
+		}
+	}
+
+	// Drop digits while the interval still holds a shorter number, then
+	// round what is left to nearest, ties to even.
+	if(vm_zeros || vr_zeros) {
+		while(vp / 10 > vm / 10) {
+			vm_zeros &= vm % 10 == 0;
+			vr_zeros &= last == 0;
+			last = vr % 10;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			removed++;
+		}
+		if(vm_zeros) {
+			while(vm % 10 == 0) {
+				vr_zeros &= last == 0;
+				last = vr % 10;
+				vr /= 10;
+				vp /= 10;
+				vm /= 10;
+				removed++;
+			}
+		}
+		if(vr_zeros && last == 5 && vr % 2 == 0) {
+			last = 4;
+		}
+		vr += (vr == vm && (!even || !vm_zeros)) || last >= 5;
+	} else {
+
+		// The usual case, where no scaled value is exact.
+		while(vp / 10 > vm / 10) {
+			round_up = vr % 10 >= 5;
+			vr /= 10;
+			vp /= 10;
+			vm /= 10;
+			removed++;
+		}
+		vr += vr == vm || round_up;
+	}
+
+	*exponentp = e10 + removed;
+
+	return vr;
+}
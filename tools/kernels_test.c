@@ -0,0 +1,129 @@
+/*
+ *	User-space check of the bulk arithmetic kernels in rpncalc_kernels.h,
+ *	built from the same source as the module's generic copy. polynomial()
+ *	must agree with plain Horner's rule, including where x to the fourth
+ *	overflows or underflows and Horner's rule does not, and when the
+ *	coefficients are split into chunks with the value carried between them.
+ *	Run it with "make -C tools check".
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Only some of the kernels are checked here.
+#define KERNEL(name) name##_generic
+#define KERNEL_TARGET __attribute__((unused))
+#include "../rpncalc_kernels.h"
+#undef KERNEL_TARGET
+#undef KERNEL
+
+#define TEST_RANDOM (200000)			// Random polynomials evaluated.
+#define TEST_DEGREE (64)				// Most coefficients of a random polynomial.
+
+static long tested;
+static long failed;
+
+static uint64_t random64(void) {
+	static uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+	// xorshift64*, so runs are repeatable.
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+static double random_unit(void) {
+	return (random64() >> 11) * 0x1p-53;
+}
+
+static double horner(const double* coefficients, int count, double x) {
+	double value = 0;
+	int i;
+
+	for(i = 0; i < count; i++) {
+		value = value * x + coefficients[i];
+	}
+
+	return value;
+}
+
+static int agrees(double value, double expected) {
+
+	// Infinities and NaNs must match in kind, finite values to within
+	// the rounding of a few dozen multiply-adds.
+	if(isnan(expected) || isnan(value)) {
+		return isnan(expected) && isnan(value);
+	}
+	if(isinf(expected) || isinf(value)) {
+		return value == expected;
+	}
+
+	return fabs(value - expected) <= 1e-13 * fabs(expected) + 1e-300;
+}
+
+static void check_polynomial(const double* coefficients, int count, double x) {
+	double expected = horner(coefficients, count, x);
+	double value;
+	int split;
+
+	// Evaluate it whole, and split in two with the value carried across.
+	tested++;
+	value = polynomial_generic(coefficients, count, x, 0);
+	if(!agrees(value, expected)) {
+		printf("polynomial of %d coefficients at %g = %.17g, Horner gives %.17g\n", count, x, value, expected);
+		failed++;
+		return;
+	}
+	for(split = 1; split < count; split += 3) {
+		tested++;
+		value = polynomial_generic(coefficients + split, count - split, x, polynomial_generic(coefficients, split, x, 0));
+		if(!agrees(value, expected)) {
+			printf("polynomial of %d coefficients split at %d at %g = %.17g, Horner gives %.17g\n", count, split, x, value, expected);
+			failed++;
+			return;
+		}
+	}
+}
+
+int main(void) {
+	static const double xs[] = {
+		0, 1, -1, 0.5, 2, 1e10, 1e76, 1e77, 1e80, -1e80, 1e100, 1e200, 1e300,
+		1e-80, -1e-80, 1e-200, 1e-310, INFINITY, -INFINITY,
+	};
+	double coefficients[TEST_DEGREE];
+	size_t k;
+	int count;
+	int i;
+	int j;
+
+	// A leading one and zeros after it, whose value is exactly x to the
+	// degree, at every length and at arguments where x to the fourth
+	// overflows, underflows or is infinite.
+	for(count = 1; count <= 12; count++) {
+		for(j = 0; j < count; j++) {
+			coefficients[j] = j ? 0 : 1;
+		}
+		for(k = 0; k < sizeof(xs) / sizeof(xs[0]); k++) {
+			check_polynomial(coefficients, count, xs[k]);
+		}
+	}
+
+	// Random polynomials with positive coefficients at positive arguments,
+	// so there is no cancellation to amplify rounding, and at arguments of
+	// every size.
+	for(i = 0; i < TEST_RANDOM; i++) {
+		count = 1 + random64() % TEST_DEGREE;
+		for(j = 0; j < count; j++) {
+			coefficients[j] = random_unit();
+		}
+		check_polynomial(coefficients, count, ldexp(random_unit() + 0.5, (int)(random64() % 2100) - 1075));
+	}
+
+	printf("%ld checked, %ld failed\n", tested, failed);
+
+	return failed ? 1 : 0;
+}
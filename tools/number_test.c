@@ -0,0 +1,272 @@
+/*
+ *	User-space check of the number conversions in rpncalc_number.h, built
+ *	from the same source as the module. parse_number() must agree bit for
+ *	bit with the C library's strtod on every input tried, and shortest()
+ *	must give digits that strtod reads back, with none shorter that do and
+ *	none closer of the same length. Run it with "make -C tools check".
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Just enough of the kernel for the conversion code.
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef unsigned __int128 u128;
+
+#define GFP_KERNEL (0)
+#define kcalloc(n, size, flags) calloc(n, size)
+#define kfree(p) free(p)
+
+#define RPNCALC_E_SUCCESS (0)
+#define RPNCALC_E_INVALID (-2)
+
+static int fls64(u64 x) {
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static u64 get_unaligned_le64(const void* p) {
+	u64 x;
+
+	memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+
+	return x;
+}
+
+#include "../rpncalc_number.h"
+
+#define TEST_RANDOM (2000000)			// Random doubles printed and read back.
+#define TEST_DIGITS (800)				// Significant digits of exact halfway cases.
+
+static long tested;
+static long failed;
+
+static u64 random64(void) {
+	static u64 state = 0x9E3779B97F4A7C15ULL;
+
+	// xorshift64*, so runs are repeatable.
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+static double random_double(void) {
+	u64 bits;
+	double value;
+
+	// Any finite double, positive or negative.
+	do {
+		bits = random64();
+		memcpy(&value, &bits, sizeof(value));
+	} while(!isfinite(value));
+
+	return value;
+}
+
+static void check_parse(const char* text) {
+	double expected;
+	double value;
+	char* end;
+
+	// Compare the bits, so the signs of zeros and NaNs count too.
+	tested++;
+	expected = strtod(text, &end);
+	if(parse_number(text, strlen(text), &value) != RPNCALC_E_SUCCESS) {
+		if(*end || end == text) {
+			return;
+		}
+		printf("parse_number rejected \"%.60s\"\n", text);
+		failed++;
+		return;
+	}
+	if(*end || end == text) {
+		printf("parse_number accepted \"%.60s\"\n", text);
+		failed++;
+		return;
+	}
+	if(memcmp(&value, &expected, sizeof(value))) {
+		printf("parse_number(\"%.60s\") = %.17g, strtod gives %.17g\n", text, value, expected);
+		failed++;
+	}
+}
+
+static void check_invalid(const char* text) {
+	double value;
+
+	tested++;
+	if(parse_number(text, strlen(text), &value) == RPNCALC_E_SUCCESS) {
+		printf("parse_number accepted \"%s\"\n", text);
+		failed++;
+	}
+}
+
+static void check_halfway(double value) {
+	static char text[TEST_DIGITS + 32];
+	long double halfway;
+	char* e;
+
+	// The point halfway to the next double needs one more bit than a
+	// double, which a long double has, and printing it with enough digits
+	// is exact. Read it as is, nudged up in its last digit, and cut short.
+	halfway = ((long double)value + nextafter(value, INFINITY)) / 2;
+	snprintf(text, sizeof(text), "%.*Le", TEST_DIGITS, halfway);
+	check_parse(text);
+	e = strchr(text, 'e');
+	memmove(e + 1, e, strlen(e) + 1);
+	*e = '1';
+	check_parse(text);
+	memmove(text + 20, e + 1, strlen(e + 1) + 1);
+	check_parse(text);
+}
+
+static int reads_back(u64 digits, int exponent, double value) {
+	char text[40];
+
+	snprintf(text, sizeof(text), "%llue%d", (unsigned long long)digits, exponent);
+
+	return strtod(text, 0) == value;
+}
+
+static u64 printed(double value, int ndigits, int* exponentp) {
+	char text[40];
+	char* p;
+	u64 digits = 0;
+
+	// The C library's correctly rounded ndigits digits of value, as an
+	// integer and a power of ten.
+	snprintf(text, sizeof(text), "%.*e", ndigits - 1, value);
+	for(p = text; *p != 'e'; p++) {
+		if(isdigit(*p)) {
+			digits = digits * 10 + (*p - '0');
+		}
+	}
+	*exponentp = atoi(p + 1) - (ndigits - 1);
+
+	return digits;
+}
+
+static void check_shortest(double value) {
+	u64 bits;
+	u64 digits;
+	u64 other;
+	int exponent;
+	int ndigits = 0;
+	int e;
+	int k;
+
+	// rpncalc_format writes zero without calling shortest().
+	if(!value) {
+		return;
+	}
+	tested++;
+	memcpy(&bits, &value, sizeof(bits));
+	digits = shortest(bits, &exponent);
+	for(other = digits; other; other /= 10) {
+		ndigits++;
+	}
+
+	// The digits must read back.
+	if(!reads_back(digits, exponent, value)) {
+		printf("shortest(%.17g) = %llue%d, which reads back differently\n", value, (unsigned long long)digits, exponent);
+		failed++;
+		return;
+	}
+
+	// No number with fewer digits may read back. Only the ones either side
+	// of the value can.
+	if(ndigits > 1) {
+		other = printed(value, ndigits - 1, &e);
+		for(k = -1; k <= 1; k++) {
+			if(other + k && reads_back(other + k, e, value)) {
+				printf("shortest(%.17g) = %llue%d, but %llue%d reads back\n", value, (unsigned long long)digits, exponent, (unsigned long long)(other + k), e);
+				failed++;
+				return;
+			}
+		}
+	}
+
+	// Of the numbers with as many digits, the closest must be chosen.
+	other = printed(value, ndigits, &e);
+	if(reads_back(other, e, value) && (other != digits || e != exponent)) {
+		printf("shortest(%.17g) = %llue%d, but %llue%d is closer\n", value, (unsigned long long)digits, exponent, (unsigned long long)other, e);
+		failed++;
+	}
+}
+
+int main(void) {
+	static const char* cases[] = {
+		"0", "-0", "+0", "0.0", "0e999", "1", "-1", "0.1", "1e23", "1E-7",
+		"9007199254740993", "9007199254740993.000000000000000000000000000001",
+		"9007199254740995", "2.2250738585072011e-308", "2.2250738585072012e-308",
+		"4.9406564584124654e-324", "2.4703282292062327e-324",
+		"2.4703282292062328e-324", "1.7976931348623157e308",
+		"1.7976931348623158e308", "1.7976931348623159e308", "1e999", "-1e999",
+		"1e-999", "123456789012345678901234567890", ".5", "5.", "00000000000001.5",
+		"0.000000000000000000000000000000000000000000001e45",
+		"inf", "-inf", "+Infinity", "nan", "NaN",
+	};
+	static const char* invalid[] = {
+		"", "-", "+", ".", "e5", "1e", "1e+", "1.2.3", "0x10", "1 ", " 1",
+		"1e5e5", "--1", "in", "infinityy", "nana",
+	};
+	char text[64];
+	double value;
+	size_t k;
+	int i;
+
+	for(k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+		check_parse(cases[k]);
+	}
+	for(k = 0; k < sizeof(invalid) / sizeof(invalid[0]); k++) {
+		check_invalid(invalid[k]);
+	}
+
+	// Random doubles written with every precision, which covers the fast
+	// path, Eisel-Lemire and inputs too long for a 64-bit mantissa.
+	for(i = 0; i < TEST_RANDOM; i++) {
+		value = random_double();
+		snprintf(text, sizeof(text), "%.*e", (int)(random64() % 25), value);
+		check_parse(text);
+		snprintf(text, sizeof(text), "%.17g", value);
+		check_parse(text);
+	}
+
+	// Exact halfway cases, which only round_digits can settle.
+	for(i = 0; i < TEST_RANDOM / 100; i++) {
+		value = fabs(random_double());
+		if(value < 0x1.fffffffffffffp1023) {
+			check_halfway(value);
+		}
+	}
+
+	// Shortest digits of random doubles, and of powers of two and the
+	// smallest subnormals, where the gap below a double is narrower than
+	// the one above.
+	for(i = 0; i < TEST_RANDOM; i++) {
+		check_shortest(fabs(random_double()));
+	}
+	for(i = -1074; i <= 1023; i++) {
+		check_shortest(ldexp(1, i));
+		check_shortest(nextafter(ldexp(1, i), INFINITY));
+		check_shortest(nextafter(ldexp(1, i), 0));
+	}
+	for(i = 1; i < 1000; i++) {
+		check_shortest(i * 0x1p-1074);
+		check_shortest(i);
+		check_shortest(i / 1000.0);
+	}
+
+	printf("%ld checked, %ld failed\n", tested, failed);
+
+	return failed ? 1 : 0;
+}